@@ -0,0 +1,202 @@
+// microbenchmark of config file parsing on a large generated file.
+// compares the fgets + static buffer + linear strcmp parser conf_parse.c
+// used to have with the whole file + hash index parser, in cpu time per line:
+//   legacy   old conf_parse_file, kept below as it was
+//   file     conf_parse_file, builds the hash index on every call
+//   reload   conf_ctx_parse_file with an index built once, a policy reload
+//
+// usage: conf_bench [lines] [commands]
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf_parse.h"
+
+static long long cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int legacy_parse_line(parse_command_t *const cmds,
+                             const char *const line, size_t line_len,
+                             const char *const confile, size_t line_num) {
+    static char key[CONF_MAX_LINE_LEN], value[CONF_MAX_LINE_LEN];
+    char *pkey, *pvalue;
+    size_t keylen = 0, valuelen = 0;
+    char const *p = line;
+
+    if (line_len == 0) {
+        return 0;
+    }
+
+    // skip spaces
+    while (*p && (*p == ' ' || *p == '\t')) p++;
+    if (!*p) {
+        printf("invalid conf at file %s, line %ld - %s\n", confile,
+               (long)line_num, line);
+        return -1;
+    }
+
+    // command out line
+    if (*p == '#' || *p == '\r' || *p == '\n' || *p == '[') {
+        return 0;
+    }
+
+    // find key
+    pkey = key;
+    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+        *pkey++ = *p++;
+        keylen++;
+    }
+    *pkey = '\0';
+
+    // skip spaces, value may empty
+    while (*p && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+
+    // set value
+    pvalue = value;
+    while (*p && *p != '\r' && *p != '\n') {
+        *pvalue++ = *p++;
+        valuelen++;
+    }
+    // trim valuestring
+    while (pvalue > value && (*(pvalue - 1) == ' ' || *(pvalue - 1) == '\t')) {
+        pvalue--;
+    }
+    *pvalue = '\0';
+
+    // call parse_fn
+    parse_command_t *it = cmds;
+    for (it = cmds; it->cmd; it++) {
+        if (strcmp(it->cmd, key) == 0) {
+            if (it->parse_func(it->addr, it->addr_cap, value, valuelen) < 0) {
+                printf(
+                    "parsefunc return error, cmd %s, file %s, line %ld - %s\n",
+                    it->cmd, confile, (long)line_num, line);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int legacy_parse_file(parse_command_t *const cmds,
+                             char const *const confile) {
+    FILE *f = NULL;
+    static char line[CONF_MAX_LINE_LEN];
+
+    if (cmds == NULL || confile == NULL) {
+        return -1;
+    }
+
+    f = fopen(confile, "r");
+    if (f == NULL) {
+        return -1;
+    }
+
+    int line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (legacy_parse_line(cmds, line, strlen(line), confile, line_num) <
+            0) {
+            printf("parse conf %s failed\n", confile);
+            fclose(f);
+            return -1;
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+// sum of values, so no parser can skip the work.
+static int sum_value(void *addr, size_t addr_cap, void *value,
+                     size_t value_len) {
+    (void)addr_cap;
+    (void)value_len;
+    *(long long *)addr += atoll(value);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int nlines = argc > 1 ? atoi(argv[1]) : 100000;
+    int ncmds = argc > 2 ? atoi(argv[2]) : 256;
+    int i;
+    long long sum[3] = {0, 0, 0};
+    char path[] = "/tmp/conf_bench_XXXXXX";
+
+    if (nlines <= 0 || ncmds <= 0) {
+        fprintf(stderr, "usage: %s [lines] [commands]\n", argv[0]);
+        return 1;
+    }
+    parse_command_t *cmds = calloc(ncmds + 1, sizeof(parse_command_t));
+    char (*names)[32] = calloc(ncmds, sizeof(*names));
+    for (i = 0; i < ncmds; i++) {
+        snprintf(names[i], sizeof(names[i]), "group_%d_limit", i);
+        cmds[i].cmd = names[i];
+        cmds[i].parse_func = sum_value;
+        cmds[i].desc = "";
+    }
+
+    int fd = mkstemp(path);
+    FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+    if (f == NULL) {
+        perror("mkstemp");
+        return 1;
+    }
+    srand(1);
+    for (i = 0; i < nlines; i++) {
+        if (i % 20 == 0) {
+            fprintf(f, "# section %d\n", i / 20);
+        } else {
+            fprintf(f, "%s  %d\n", names[rand() % ncmds], i);
+        }
+    }
+    fclose(f);
+
+    conf_ctx_t ctx;
+    conf_ctx_init(&ctx, cmds);
+    // warm the page cache
+    for (i = 0; i < ncmds; i++) {
+        cmds[i].addr = &sum[0];
+    }
+    legacy_parse_file(cmds, path);
+    sum[0] = 0;
+
+    const char *names_out[] = {"legacy", "file", "reload"};
+    long long t[4];
+    t[0] = cpu_ns();
+    legacy_parse_file(cmds, path);
+    for (i = 0; i < ncmds; i++) {
+        cmds[i].addr = &sum[1];
+    }
+    t[1] = cpu_ns();
+    conf_parse_file(cmds, path);
+    for (i = 0; i < ncmds; i++) {
+        cmds[i].addr = &sum[2];
+    }
+    t[2] = cpu_ns();
+    conf_ctx_parse_file(&ctx, path);
+    t[3] = cpu_ns();
+
+    printf("parser\tlines\tcommands\tns_per_line\n");
+    for (i = 0; i < 3; i++) {
+        printf("%s\t%d\t%d\t%.1f\n", names_out[i], nlines, ncmds,
+               (double)(t[i + 1] - t[i]) / nlines);
+    }
+    printf("# speedup %.2fx\n", (double)(t[1] - t[0]) / (t[3] - t[2]));
+    if (sum[0] != sum[1] || sum[0] != sum[2]) {
+        printf("# results differ: %lld %lld %lld\n", sum[0], sum[1], sum[2]);
+    }
+
+    conf_ctx_free(&ctx);
+    unlink(path);
+    free(names);
+    free(cmds);
+    return sum[0] != sum[1] || sum[0] != sum[2];
+}
@@ -0,0 +1,459 @@
+// deterministic simulator of the limiter: controllers run against
+// simulated processes in virtual time, no cpu is spun and no signal sent.
+//
+// every combination of controller, limit, interval, demand curve and seed
+// is run, each scenario prints (with -v) a tab separated line:
+//   achieved   cpu percent the simulated process got after warm up
+//   error      achieved - min(limit, mean demand)
+//   osc        stddev of usage over 100ms slices
+//   sig_per_s  SIGSTOP + SIGCONT per second
+// and a summary per controller. -e and -o fail the run (exit 1) when the
+// mean absolute error or the worst overshoot of a controller is above
+// them, for CI.
+//
+// curves, demand in percent of one cpu:
+//   const:D             always D
+//   square:H,L,ON,OFF   H for ON ms, then L for OFF ms
+//   ramp:A,B,S          from A to B over S seconds
+//   sine:M,A,P          M + A*sin(), period P ms
+//   trace:FILE          tick usage of the first pid of a --trace-file,
+//                       repeated; usage while stopped is held
+//
+// usage: controller_sim [-d seconds] [-c threshold,pid,pwm] [-p 5,25,50]
+//                       [-i 10,50] [-n seeds] [-j jitter] [-w curve;...]
+//                       [-e max_mean_abs_error] [-o max_overshoot] [-v]
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "controller.h"
+#include "limiter.h"
+#include "trace.h"
+
+#define MAX_LIST 32
+#define SIM_NPROC 4
+#define SLICE_NS 100000000LL
+#define STEP_NS 1000000LL
+#define WARMUP_NS 2000000000LL
+
+#define CURVE_CONST 0
+#define CURVE_SQUARE 1
+#define CURVE_RAMP 2
+#define CURVE_SINE 3
+#define CURVE_TRACE 4
+
+struct curve {
+    char spec[256];
+    int kind;
+    double a, b, c, d;
+    // CURVE_TRACE: demand every step_ns
+    double *samples;
+    int nsamples;
+    long long step_ns;
+};
+
+// the simulated process and clocks, io_ctx of the limiter.
+struct sim {
+    long long now_ns;
+    double cpu_ns;
+    // integral of demand after warm up, in cpu ns
+    double demand_ns;
+    int stopped;
+    long nsignals;
+    const struct curve *curve;
+};
+
+static double demand_at(const struct curve *c, long long ns) {
+    double s = ns / 1e9, d;
+    switch (c->kind) {
+        case CURVE_SQUARE: {
+            long long period = (long long)((c->c + c->d) * 1e6);
+            d = ns % period < (long long)(c->c * 1e6) ? c->a : c->b;
+            break;
+        }
+        case CURVE_RAMP:
+            d = s >= c->c ? c->b : c->a + (c->b - c->a) * s / c->c;
+            break;
+        case CURVE_SINE:
+            d = c->a + c->b * sin(2 * M_PI * s * 1000 / c->c);
+            break;
+        case CURVE_TRACE:
+            d = c->samples[(ns / c->step_ns) % c->nsamples];
+            break;
+        default:
+            d = c->a;
+            break;
+    }
+    if (d < 0) {
+        d = 0;
+    }
+    return d > SIM_NPROC * 100 ? SIM_NPROC * 100 : d;
+}
+
+// tick usage of the first pid of a trace file while it was running.
+static int load_trace_curve(struct curve *c, const char *path) {
+    struct trace_header h;
+    struct trace_record r, prev;
+    int have_prev = 0, cap = 0, pid = 0;
+    double last = 0;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL || fread(&h, sizeof(h), 1, fp) != 1 ||
+        memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.record_size != sizeof(r)) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return -1;
+    }
+    // records in file order, a wrapped ring starts in the middle
+    long long n = h.count < h.capacity ? h.count : h.capacity;
+    long long first = (h.count - n) % h.capacity, i;
+    c->step_ns = h.interval_ms * 1000000LL;
+    for (i = 0; i < n; i++) {
+        fseek(fp, sizeof(h) + ((first + i) % h.capacity) * sizeof(r),
+              SEEK_SET);
+        if (fread(&r, sizeof(r), 1, fp) != 1) {
+            break;
+        }
+        if (pid == 0) {
+            pid = r.pid;
+        }
+        if (r.pid != pid) {
+            continue;
+        }
+        if (have_prev && !prev.stopped && r.total > prev.total) {
+            last = (r.proc_time - prev.proc_time) * 100.0 /
+                   (r.total - prev.total) * h.nproc;
+        }
+        if (have_prev) {
+            if (c->nsamples == cap) {
+                cap = cap ? cap * 2 : 1024;
+                c->samples = realloc(c->samples, cap * sizeof(double));
+            }
+            c->samples[c->nsamples++] = last;
+        }
+        prev = r;
+        have_prev = 1;
+    }
+    fclose(fp);
+    if (c->nsamples == 0) {
+        fprintf(stderr, "%s: no samples\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_curve(struct curve *c, const char *spec) {
+    memset(c, 0, sizeof(*c));
+    snprintf(c->spec, sizeof(c->spec), "%s", spec);
+    if (sscanf(spec, "const:%lf", &c->a) == 1) {
+        c->kind = CURVE_CONST;
+    } else if (sscanf(spec, "square:%lf,%lf,%lf,%lf", &c->a, &c->b, &c->c,
+                      &c->d) == 4 &&
+               c->c + c->d > 0) {
+        c->kind = CURVE_SQUARE;
+    } else if (sscanf(spec, "ramp:%lf,%lf,%lf", &c->a, &c->b, &c->c) == 3 &&
+               c->c > 0) {
+        c->kind = CURVE_RAMP;
+    } else if (sscanf(spec, "sine:%lf,%lf,%lf", &c->a, &c->b, &c->c) == 3 &&
+               c->c > 0) {
+        c->kind = CURVE_SINE;
+    } else if (strncmp(spec, "trace:", 6) == 0) {
+        c->kind = CURVE_TRACE;
+        return load_trace_curve(c, spec + 6);
+    } else {
+        fprintf(stderr, "invalid curve %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+static int sim_attach(struct limiter *l, struct target *t) {
+    (void)l;
+    t->capacity = SIM_NPROC * 100;
+    return 0;
+}
+
+static void sim_detach(struct limiter *l, struct target *t) {
+    (void)l;
+    (void)t;
+}
+
+static int sim_sample(struct limiter *l, struct target *t,
+                      long long *proc_time) {
+    struct sim *s = l->io_ctx;
+    (void)t;
+    *proc_time = (long long)s->cpu_ns;
+    return 0;
+}
+
+static long long sim_total(struct limiter *l) {
+    struct sim *s = l->io_ctx;
+    return s->now_ns * l->nproc;
+}
+
+static void sim_signal(struct limiter *l, struct target *t, int sig) {
+    struct sim *s = l->io_ctx;
+    (void)t;
+    s->stopped = sig == SIGSTOP;
+    s->nsignals++;
+}
+
+static double sim_capacity(struct limiter *l, struct target *t) {
+    (void)l;
+    (void)t;
+    return SIM_NPROC * 100;
+}
+
+static long long sim_now(struct limiter *l) {
+    return ((struct sim *)l->io_ctx)->now_ns;
+}
+
+static const struct limiter_io sim_io = {
+    "sim",      sim_attach,   sim_detach, sim_sample, sim_total,
+    sim_signal, sim_capacity, NULL,       NULL,       NULL,
+    sim_now};
+
+// run the simulated process from s->now_ns to end in STEP_NS steps.
+static void advance(struct sim *s, long long end) {
+    while (s->now_ns < end) {
+        long long step = end - s->now_ns < STEP_NS ? end - s->now_ns : STEP_NS;
+        double d = demand_at(s->curve, s->now_ns);
+        if (!s->stopped) {
+            s->cpu_ns += step * d / 100;
+        }
+        if (s->now_ns >= WARMUP_NS) {
+            s->demand_ns += step * d / 100;
+        }
+        s->now_ns += step;
+    }
+}
+
+struct result {
+    double achieved, ideal, osc, sig_per_s;
+};
+
+// xorshift, the same seed gives the same tick jitter everywhere
+static unsigned long long next_rand(unsigned long long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static int run_one(const struct controller_conf *conf, double limit,
+                   long interval_ms, const struct curve *curve,
+                   unsigned long long seed, double jitter, int duration_s,
+                   struct result *r) {
+    struct limiter l;
+    struct sim s;
+    unsigned long long rnd = seed * 2654435761ULL + 1;
+    long long end = WARMUP_NS + duration_s * 1000000000LL;
+    double start_cpu = 0, slice_cpu = 0, sum = 0, sum2 = 0;
+    long long next_slice = WARMUP_NS;
+    long start_signals = 0;
+    int nslices = 0;
+
+    memset(&s, 0, sizeof(s));
+    s.curve = curve;
+    if (limiter_init(&l, interval_ms, conf) < 0) {
+        return -1;
+    }
+    l.io = &sim_io;
+    l.io_ctx = &s;
+    l.nproc = SIM_NPROC;
+    l.capacity = SIM_NPROC;
+    l.accounting = ACCOUNTING_CPUCLOCK;
+    if (limiter_add(&l, 1, limit, 0) == NULL) {
+        limiter_free(&l);
+        return -1;
+    }
+
+    while (s.now_ns < end) {
+        limiter_tick(&l, get_total_cpu_usage(&l));
+        // a tick is late or early by up to jitter of the interval
+        double j = (next_rand(&rnd) % 2001 / 1000.0 - 1) * jitter;
+        long long next = s.now_ns + (long long)(interval_ms * 1e6 * (1 + j));
+        while (s.now_ns < next) {
+            long long to = next < next_slice ? next : next_slice;
+            advance(&s, to);
+            if (s.now_ns == WARMUP_NS) {
+                start_cpu = slice_cpu = s.cpu_ns;
+                start_signals = s.nsignals;
+            }
+            if (s.now_ns == next_slice) {
+                if (s.now_ns > WARMUP_NS) {
+                    double u = (s.cpu_ns - slice_cpu) * 100.0 / SLICE_NS;
+                    sum += u;
+                    sum2 += u * u;
+                    nslices++;
+                }
+                slice_cpu = s.cpu_ns;
+                next_slice += SLICE_NS;
+            }
+        }
+    }
+    limiter_free(&l);
+
+    double seconds = (s.now_ns - WARMUP_NS) / 1e9;
+    double mean_demand = s.demand_ns * 100.0 / (s.now_ns - WARMUP_NS);
+    r->achieved = (s.cpu_ns - start_cpu) * 100.0 / (s.now_ns - WARMUP_NS);
+    r->ideal = mean_demand < limit ? mean_demand : limit;
+    double mean = nslices ? sum / nslices : 0;
+    double var = nslices ? sum2 / nslices - mean * mean : 0;
+    r->osc = var > 0 ? sqrt(var) : 0;
+    r->sig_per_s = (s.nsignals - start_signals) / seconds;
+    return 0;
+}
+
+// split s by sep into list in place, return number of items.
+static int split(char *s, const char *sep, char **list, int max) {
+    int n = 0;
+    char *save = NULL;
+    char *tok = strtok_r(s, sep, &save);
+    while (tok && n < max) {
+        list[n++] = tok;
+        tok = strtok_r(NULL, sep, &save);
+    }
+    return n;
+}
+
+struct summary {
+    int n;
+    double abs_err, max_over, sig_per_s;
+};
+
+int main(int argc, char *argv[]) {
+    char controllers_s[256] = "threshold,pid,pwm";
+    char percents_s[256] = "5,10,25,50,75,90,150,250";
+    char intervals_s[256] = "10,50";
+    char curves_s[2048] =
+        "const:100;const:400;const:30;square:100,0,200,300;"
+        "square:300,20,50,50;ramp:0,200,20;sine:80,60,2000";
+    char *controllers[MAX_LIST], *percents[MAX_LIST], *intervals[MAX_LIST],
+        *curve_specs[MAX_LIST];
+    struct curve curves[MAX_LIST];
+    struct summary sums[MAX_LIST];
+    int duration_s = 20, nseeds = 5, verbose = 0;
+    double jitter = 0.2, max_err = -1, max_over = -1;
+    int opt, ic, ip, ii, iw, seed, failed = 0;
+
+    while ((opt = getopt(argc, argv, "d:c:p:i:n:j:w:e:o:v")) != -1) {
+        switch (opt) {
+            case 'd':
+                duration_s = atoi(optarg);
+                break;
+            case 'c':
+                snprintf(controllers_s, sizeof(controllers_s), "%s", optarg);
+                break;
+            case 'p':
+                snprintf(percents_s, sizeof(percents_s), "%s", optarg);
+                break;
+            case 'i':
+                snprintf(intervals_s, sizeof(intervals_s), "%s", optarg);
+                break;
+            case 'n':
+                nseeds = atoi(optarg);
+                break;
+            case 'j':
+                jitter = atof(optarg);
+                break;
+            case 'w':
+                snprintf(curves_s, sizeof(curves_s), "%s", optarg);
+                break;
+            case 'e':
+                max_err = atof(optarg);
+                break;
+            case 'o':
+                max_over = atof(optarg);
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-d seconds] [-c controllers] [-p percents] "
+                        "[-i intervals] [-n seeds] [-j jitter] [-w curves] "
+                        "[-e max_mean_abs_error] [-o max_overshoot] [-v]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (duration_s <= 0) {
+        duration_s = 1;
+    }
+    if (nseeds <= 0) {
+        nseeds = 1;
+    }
+
+    int nc = split(controllers_s, ",", controllers, MAX_LIST);
+    int np = split(percents_s, ",", percents, MAX_LIST);
+    int ni = split(intervals_s, ",", intervals, MAX_LIST);
+    int nw = split(curves_s, ";", curve_specs, MAX_LIST);
+    for (iw = 0; iw < nw; iw++) {
+        if (parse_curve(&curves[iw], curve_specs[iw]) < 0) {
+            return 1;
+        }
+    }
+    memset(sums, 0, sizeof(sums));
+
+    if (verbose) {
+        printf("controller\tpercent\tinterval_ms\tcurve\tseed\tachieved\t"
+               "error\tosc\tsig_per_s\n");
+    }
+    for (ic = 0; ic < nc; ic++) {
+        struct controller_conf conf;
+        if (controller_parse(&conf, controllers[ic]) < 0) {
+            return 1;
+        }
+        for (ip = 0; ip < np; ip++) {
+            for (ii = 0; ii < ni; ii++) {
+                for (iw = 0; iw < nw; iw++) {
+                    for (seed = 1; seed <= nseeds; seed++) {
+                        struct result r;
+                        double limit = atof(percents[ip]);
+                        if (run_one(&conf, limit, atol(intervals[ii]),
+                                    &curves[iw], seed, jitter, duration_s,
+                                    &r) < 0) {
+                            return 1;
+                        }
+                        double err = r.achieved - r.ideal;
+                        struct summary *sum = &sums[ic];
+                        sum->n++;
+                        sum->abs_err += fabs(err);
+                        sum->sig_per_s += r.sig_per_s;
+                        if (r.achieved - limit > sum->max_over) {
+                            sum->max_over = r.achieved - limit;
+                        }
+                        if (verbose) {
+                            printf("%s\t%s\t%s\t%s\t%d\t%.2f\t%.2f\t%.2f\t%.1f"
+                                   "\n",
+                                   controllers[ic], percents[ip], intervals[ii],
+                                   curves[iw].spec, seed, r.achieved, err,
+                                   r.osc, r.sig_per_s);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    printf("controller\tscenarios\tmean_abs_error\tmax_overshoot\t"
+           "sig_per_s\n");
+    for (ic = 0; ic < nc; ic++) {
+        struct summary *sum = &sums[ic];
+        double mean_err = sum->abs_err / sum->n;
+        printf("%s\t%d\t%.3f\t%.3f\t%.1f\n", controllers[ic], sum->n, mean_err,
+               sum->max_over, sum->sig_per_s / sum->n);
+        if ((max_err >= 0 && mean_err > max_err) ||
+            (max_over >= 0 && sum->max_over > max_over)) {
+            fprintf(stderr, "controller %s is out of bounds\n",
+                    controllers[ic]);
+            failed = 1;
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,350 @@
+// accuracy and overhead benchmark of cpu_limit_run.
+//
+// every combination of workload, percent, interval and controller is run
+// for a few seconds, results are printed as a tab separated table:
+//   achieved   cpu percent the workload got while measured
+//   error      achieved - percent
+//   osc        stddev of usage over 100ms slices, oscillation amplitude
+//   lim_cpu    cpu percent used by cpu_limit_run itself
+//   sig_per_s  SIGSTOP + SIGCONT sent per second
+//   stall_*    length of continuous stops in ms, median, p99 and max, from
+//              a --trace-file of the run
+//
+// usage: limit_bench [-d seconds] [-w spin,threads,bursty,io] [-p 20,50]
+//                    [-i 10,50] [-c threshold,pid,pwm] [-x "extra args"]
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <libgen.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAX_LIST 16
+#define MAX_ARGS 64
+#define MAX_PATH_LEN 512
+#define SLICE_MS 100
+
+static char bin_dir[MAX_PATH_LEN];
+
+struct result {
+    double achieved, osc, lim_cpu, sig_per_s;
+    double stall_p50, stall_p99, stall_max;
+};
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long cpu_ns(clockid_t clock) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) < 0) {
+        return -1;
+    }
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ms(long ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    while (nanosleep(&ts, &ts) < 0) {
+    }
+}
+
+// split s by sep into list in place, return number of items.
+static int split(char *s, const char *sep, char **list, int max) {
+    int n = 0;
+    char *save = NULL;
+    char *tok = strtok_r(s, sep, &save);
+    while (tok && n < max) {
+        list[n++] = tok;
+        tok = strtok_r(NULL, sep, &save);
+    }
+    return n;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+// stall lengths of pid between start and end ns from the trace at path,
+// percentiles are left 0 when it was never stopped.
+static void stall_stats(const char *path, int pid, long long start,
+                        long long end, struct result *r) {
+    r->stall_p50 = r->stall_p99 = r->stall_max = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 ||
+        st.st_size < (off_t)sizeof(struct trace_header)) {
+        close(fd);
+        return;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return;
+    }
+    const struct trace_header *h = p;
+    const struct trace_record *records =
+        (const struct trace_record *)((const char *)p + sizeof(*h));
+    uint64_t i = h->count > h->capacity ? h->count - h->capacity : 0;
+    long long *stalls = malloc(sizeof(long long) * (h->count - i + 1));
+    if (stalls == NULL) {
+        munmap(p, st.st_size);
+        return;
+    }
+    long long stop_ns = 0;
+    size_t n = 0;
+    for (; i < h->count; i++) {
+        const struct trace_record *rec = &records[i % h->capacity];
+        if (rec->pid != pid || rec->ts_ns > end) {
+            continue;
+        }
+        if (rec->event == TRACE_STOP) {
+            stop_ns = rec->ts_ns;
+        } else if (stop_ns && (rec->event == TRACE_CONT ||
+                               rec->event == TRACE_EXIT)) {
+            if (stop_ns >= start) {
+                stalls[n++] = rec->ts_ns - stop_ns;
+            }
+            stop_ns = 0;
+        }
+    }
+    if (n > 0) {
+        qsort(stalls, n, sizeof(long long), cmp_ll);
+        r->stall_p50 = stalls[n / 2] / 1e6;
+        r->stall_p99 = stalls[n * 99 / 100] / 1e6;
+        r->stall_max = stalls[n - 1] / 1e6;
+    }
+    free(stalls);
+    munmap(p, st.st_size);
+}
+
+static int spawn(char **argv, int stderr_fd) {
+    int pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(stderr_fd >= 0 ? stderr_fd : null_fd, STDERR_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+// percent is given to --percent as it was written.
+static int run_one(const char *workload, const char *percent, int interval_ms,
+                   const char *controller, char **extra, int nextra,
+                   int duration_s, struct result *r) {
+    char workload_bin[MAX_PATH_LEN + 16], limiter_bin[MAX_PATH_LEN + 16];
+    char pid_arg[32], interval_arg[32];
+    char trace_path[64];
+    char *wargv[] = {workload_bin, (char *)workload, NULL};
+    char *largv[MAX_ARGS];
+    int nargs = 0, i;
+    int pipefd[2];
+
+    sprintf(workload_bin, "%s/workload", bin_dir);
+    sprintf(limiter_bin, "%s/cpu_limit_run", bin_dir);
+
+    int wpid = spawn(wargv, -1);
+    if (wpid < 0) {
+        return -1;
+    }
+    clockid_t clock;
+    clock_getcpuclockid(wpid, &clock);
+
+    sprintf(pid_arg, "%d", wpid);
+    sprintf(interval_arg, "%d", interval_ms);
+    largv[nargs++] = limiter_bin;
+    largv[nargs++] = "--pid";
+    largv[nargs++] = pid_arg;
+    largv[nargs++] = "--percent";
+    largv[nargs++] = (char *)percent;
+    largv[nargs++] = "--interval-ms";
+    largv[nargs++] = interval_arg;
+    largv[nargs++] = "--controller";
+    largv[nargs++] = (char *)controller;
+    largv[nargs++] = "--report";
+    largv[nargs++] = "yes";
+    sprintf(trace_path, "/tmp/limit_bench_%d.trace", (int)getpid());
+    largv[nargs++] = "--trace-file";
+    largv[nargs++] = trace_path;
+    largv[nargs++] = "--trace-size";
+    largv[nargs++] = "16m";
+    for (i = 0; i < nextra && nargs < MAX_ARGS - 1; i++) {
+        largv[nargs++] = extra[i];
+    }
+    largv[nargs] = NULL;
+
+    pipe(pipefd);
+    long long lim_start = now_ns();
+    int lpid = spawn(largv, pipefd[1]);
+    close(pipefd[1]);
+
+    // skip the first history window and start up
+    sleep_ms(500 + 30L * interval_ms);
+
+    int nslices = duration_s * 1000 / SLICE_MS;
+    double sum = 0, sum2 = 0;
+    long long start = now_ns(), start_cpu = cpu_ns(clock);
+    long long last = start, last_cpu = start_cpu;
+    for (i = 0; i < nslices; i++) {
+        sleep_ms(SLICE_MS);
+        long long t = now_ns(), c = cpu_ns(clock);
+        double u = (c - last_cpu) * 100.0 / (t - last);
+        sum += u;
+        sum2 += u * u;
+        last = t;
+        last_cpu = c;
+    }
+    r->achieved = (last_cpu - start_cpu) * 100.0 / (last - start);
+    double mean = sum / nslices;
+    double var = sum2 / nslices - mean * mean;
+    r->osc = var > 0 ? sqrt(var) : 0;
+
+    kill(lpid, SIGTERM);
+    char report[4096];
+    int len = 0, n;
+    while ((n = read(pipefd[0], report + len, sizeof(report) - 1 - len)) > 0) {
+        len += n;
+    }
+    report[len] = '\0';
+    close(pipefd[0]);
+
+    struct rusage ru;
+    int status;
+    wait4(lpid, &status, 0, &ru);
+    double lim_s = (now_ns() - lim_start) / 1e9;
+    double lim_cpu_s = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    r->lim_cpu = lim_cpu_s * 100.0 / lim_s;
+
+    long stops = 0, conts = 0;
+    char *p = strstr(report, "stops=");
+    if (p) {
+        sscanf(p, "stops=%ld conts=%ld", &stops, &conts);
+    }
+    r->sig_per_s = (stops + conts) / lim_s;
+    stall_stats(trace_path, wpid, start, last, r);
+    unlink(trace_path);
+
+    kill(wpid, SIGCONT);
+    kill(wpid, SIGKILL);
+    waitpid(wpid, &status, 0);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    char workloads_s[256] = "spin,threads,bursty,io";
+    char percents_s[256] = "20,50";
+    char intervals_s[256] = "10,50";
+    char controllers_s[256] = "threshold,pid,pwm";
+    char extra_s[1024] = "";
+    char *workloads[MAX_LIST], *percents[MAX_LIST], *intervals[MAX_LIST],
+        *controllers[MAX_LIST], *extra[MAX_ARGS];
+    int duration_s = 3;
+    int opt, iw, ip, ii, ic;
+
+    while ((opt = getopt(argc, argv, "d:w:p:i:c:x:")) != -1) {
+        switch (opt) {
+            case 'd':
+                duration_s = atoi(optarg);
+                break;
+            case 'w':
+                snprintf(workloads_s, sizeof(workloads_s), "%s", optarg);
+                break;
+            case 'p':
+                snprintf(percents_s, sizeof(percents_s), "%s", optarg);
+                break;
+            case 'i':
+                snprintf(intervals_s, sizeof(intervals_s), "%s", optarg);
+                break;
+            case 'c':
+                snprintf(controllers_s, sizeof(controllers_s), "%s", optarg);
+                break;
+            case 'x':
+                snprintf(extra_s, sizeof(extra_s), "%s", optarg);
+                break;
+            default:
+                fprintf(stderr,
+                        "usage: %s [-d seconds] [-w workloads] [-p percents] "
+                        "[-i intervals] [-c controllers] [-x extra_args]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+    if (duration_s <= 0) {
+        duration_s = 1;
+    }
+
+    char exe[MAX_PATH_LEN];
+    ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (n <= 0) {
+        perror("readlink");
+        return 1;
+    }
+    exe[n] = '\0';
+    snprintf(bin_dir, sizeof(bin_dir), "%s", dirname(exe));
+
+    int nw = split(workloads_s, ",", workloads, MAX_LIST);
+    int np = split(percents_s, ",", percents, MAX_LIST);
+    int ni = split(intervals_s, ",", intervals, MAX_LIST);
+    int nc = split(controllers_s, ",", controllers, MAX_LIST);
+    int nextra = split(extra_s, " ", extra, MAX_ARGS - 16);
+    // fractional percents such as 12.5 are passed on as written
+    double percent_values[MAX_LIST];
+    for (ip = 0; ip < np; ip++) {
+        char *end;
+        percent_values[ip] = strtod(percents[ip], &end);
+        if (end == percents[ip] || *end != '\0' || percent_values[ip] <= 0) {
+            fprintf(stderr, "invalid percent %s\n", percents[ip]);
+            return 1;
+        }
+    }
+
+    printf(
+        "workload\tpercent\tinterval_ms\tcontroller\tachieved\terror\tosc\t"
+        "lim_cpu\tsig_per_s\tstall_p50\tstall_p99\tstall_max\n");
+    fflush(stdout);
+    for (iw = 0; iw < nw; iw++) {
+        for (ip = 0; ip < np; ip++) {
+            for (ii = 0; ii < ni; ii++) {
+                for (ic = 0; ic < nc; ic++) {
+                    struct result r;
+                    double percent = percent_values[ip];
+                    if (run_one(workloads[iw], percents[ip],
+                                atoi(intervals[ii]), controllers[ic], extra,
+                                nextra, duration_s, &r) < 0) {
+                        continue;
+                    }
+                    printf("%s\t%g\t%s\t%s\t%.2f\t%.2f\t%.2f\t%.3f\t%.1f\t"
+                           "%.1f\t%.1f\t%.1f\n",
+                           workloads[iw], percent, intervals[ii],
+                           controllers[ic], r.achieved, r.achieved - percent,
+                           r.osc, r.lim_cpu, r.sig_per_s, r.stall_p50,
+                           r.stall_p99, r.stall_max);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+// microbenchmark of one limiter sample: /proc/stat plus /proc/<pid>/stat.
+// compares the fopen/fscanf path cpu_limit_run used to have with the
+// persistent fd + pread path in src/sample.c, in cpu time per sample.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sample.h"
+
+static long long cpu_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long stdio_sample(const char *stat_file) {
+    long long user, nice, system, idle;
+    long utime, stime, cutime, cstime;
+    long long starttime;
+
+    FILE *fp = fopen("/proc/stat", "r");
+    fscanf(fp, "cpu %lld %lld %lld %lld", &user, &nice, &system, &idle);
+    fclose(fp);
+
+    fp = fopen(stat_file, "r");
+    fscanf(fp,
+           "%*d %*s %*c %*d "
+           "%*d %*d %*d %*d %*u %*u %*u %*u %*u "
+           "%ld %ld %ld %ld "
+           "%*d %*d %*d %*d "
+           "%lld",
+           &utime, &stime, &cutime, &cstime, &starttime);
+    fclose(fp);
+    return user + nice + system + idle + utime + stime;
+}
+
+static long long pread_sample(struct proc_file *proc_stat,
+                              struct proc_file *pid_stat) {
+    long long total = 0;
+    struct pid_stat st;
+    proc_file_read(proc_stat);
+    parse_total_cpu(proc_stat->buf, &total);
+    proc_file_read(pid_stat);
+    parse_pid_stat(pid_stat->buf, &st);
+    return total + st.utime + st.stime;
+}
+
+int main(int argc, char *argv[]) {
+    int n = argc > 1 ? atoi(argv[1]) : 20000;
+    int i;
+    char stat_file[256];
+    volatile long long sink = 0;
+    struct proc_file proc_stat, pid_stat;
+
+    sprintf(stat_file, "/proc/%d/stat", getpid());
+    proc_file_open(&proc_stat, "/proc/stat");
+    proc_file_open(&pid_stat, stat_file);
+
+    long long t0 = cpu_ns();
+    for (i = 0; i < n; i++) {
+        sink += stdio_sample(stat_file);
+    }
+    long long t1 = cpu_ns();
+    for (i = 0; i < n; i++) {
+        sink += pread_sample(&proc_stat, &pid_stat);
+    }
+    long long t2 = cpu_ns();
+
+    double stdio_ns = (double)(t1 - t0) / n;
+    double pread_ns = (double)(t2 - t1) / n;
+    printf("method\tsamples\tcpu_ns_per_sample\n");
+    printf("stdio\t%d\t%.0f\n", n, stdio_ns);
+    printf("pread\t%d\t%.0f\n", n, pread_ns);
+    printf("# speedup %.2fx\n", stdio_ns / pread_ns);
+
+    proc_file_close(&proc_stat);
+    proc_file_close(&pid_stat);
+    return 0;
+}
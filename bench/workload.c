@@ -0,0 +1,78 @@
+// synthetic workloads for limit_bench.
+//   workload spin          busy loop in one thread
+//   workload threads N     busy loop in N threads
+//   workload bursty        200ms busy, 300ms idle
+//   workload io [dir]      5ms busy, then write and sync 256k to a temp file
+//                          in dir, /tmp by default
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void spin_for(long long ns) {
+    long long end = now_ns() + ns;
+    while (now_ns() < end) {
+    }
+}
+
+static void *spin_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+    }
+    return NULL;
+}
+
+static int run_io(const char *dir) {
+    static char buf[256 * 1024];
+    char path[4096];
+    int fd;
+    snprintf(path, sizeof(path), "%s/limit_bench_io_XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return -1;
+    }
+    unlink(path);
+    memset(buf, 'x', sizeof(buf));
+    for (;;) {
+        spin_for(5 * 1000000LL);
+        pwrite(fd, buf, sizeof(buf), 0);
+        fdatasync(fd);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *mode = argc > 1 ? argv[1] : "spin";
+
+    if (strcmp(mode, "spin") == 0) {
+        spin_thread(NULL);
+    } else if (strcmp(mode, "threads") == 0) {
+        int i, n = argc > 2 ? atoi(argv[2]) : 4;
+        pthread_t tid;
+        for (i = 1; i < n; i++) {
+            pthread_create(&tid, NULL, spin_thread, NULL);
+        }
+        spin_thread(NULL);
+    } else if (strcmp(mode, "bursty") == 0) {
+        for (;;) {
+            spin_for(200 * 1000000LL);
+            usleep(300 * 1000);
+        }
+    } else if (strcmp(mode, "io") == 0) {
+        return run_io(argc > 2 ? argv[2] : "/tmp");
+    }
+    fprintf(stderr, "unknown workload %s\n", mode);
+    return 1;
+}
@@ -0,0 +1,422 @@
+/**
+ * @file selflimit.c
+ * @brief per thread accounting, ticks and cooperative sleeps of libselflimit.
+ */
+
+#define _GNU_SOURCE
+
+#include "selflimit.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf_parse.h"
+#include "controller.h"
+
+// the library is built with -fvisibility=hidden, so the controller and
+// conf_parse code linked into it never clash with symbols of the process.
+#define API __attribute__((visibility("default")))
+
+// glibc before 2.35 has no name for the target thread of SIGEV_THREAD_ID
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// same window as MAX_HISTORY_LEN of the limiter
+#define HISTORY_LEN 30
+
+struct sample {
+    long long wall, cpu;
+};
+
+// state of one thread, only ever touched by the thread itself.
+struct self_thread {
+    // of the conf controller was set up for, 0 for never
+    int generation;
+    // own limit, negative to follow conf
+    double percent;
+    int has_timer;
+    timer_t timer;
+    // in a tick, the timer handler must not start another one
+    int busy;
+    int was_stopped;
+    struct controller controller;
+    struct sample history[HISTORY_LEN];
+    int idx, n;
+    // whether the name of the thread matches conf.threads, as of
+    // match_generation. set outside the timer handler, which may not call
+    // fnmatch(), by whoever sees the name or conf change
+    volatile sig_atomic_t match;
+    int match_generation;
+    // in the registry while the thread has a timer
+    int registered;
+    pthread_t thread;
+    struct self_thread *next;
+};
+
+// initial-exec, a global dynamic tls access may allocate and is not safe in
+// the timer handler.
+static __thread struct self_thread self
+    __attribute__((tls_model("initial-exec"))) = {.percent = -1};
+
+static struct selflimit_conf conf;
+static struct controller_conf controller;
+static volatile sig_atomic_t running, generation;
+static pthread_once_t install_once = PTHREAD_ONCE_INIT;
+
+// threads with a timer, whose match is kept by the threads that rename
+// them or change conf.
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct self_thread *registry;
+// its destructor leaves the registry when a registered thread exits
+static pthread_key_t exit_key;
+
+static long long now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ns(long long ns) {
+    struct timespec ts = {ns / 1000000000LL, ns % 1000000000LL};
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) {
+    }
+}
+
+// cpu percent of the thread between two samples.
+static double usage_between(const struct sample *a, const struct sample *b) {
+    return (b->cpu - a->cpu) * 100.0 / (b->wall - a->wall);
+}
+
+static int name_matches(const char *name) {
+    return conf.threads[0] == '\0' || fnmatch(conf.threads, name, 0) == 0;
+}
+
+// match the name of the calling thread, never from the timer handler.
+static void match_self() {
+    char name[17] = "";
+    prctl(PR_GET_NAME, name);
+    self.match = name_matches(name);
+    self.match_generation = generation;
+}
+
+// limit of the calling thread now, 0 if it is not limited.
+static double thread_limit() {
+    if (self.percent >= 0) {
+        return self.percent;
+    }
+    return self.match ? conf.percent : 0;
+}
+
+static void arm_timer() {
+    long long ns = conf.interval_ms * 1000000LL;
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = ns / 1000000000LL;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = ns % 1000000000LL;
+    timer_settime(self.timer, 0, &its, NULL);
+}
+
+// one tick of the calling thread: sample its cpu clock, ask the controller
+// and sleep a tick at a time while it says stop. without force, it returns
+// at once when the previous tick is less than an interval ago.
+static void self_tick(int force) {
+    long long interval = conf.interval_ms * 1000000LL;
+    long long wall = now_ns(CLOCK_MONOTONIC);
+    int last = (self.idx + HISTORY_LEN - 1) % HISTORY_LEN;
+
+    if (self.busy ||
+        (!force && self.n > 0 && wall - self.history[last].wall < interval)) {
+        return;
+    }
+    self.busy = 1;
+    if (self.generation != generation) {
+        controller_init(&self.controller, &controller);
+        self.generation = generation;
+        self.n = self.idx = self.was_stopped = 0;
+        if (self.has_timer) {
+            arm_timer();
+        }
+    }
+    while (running) {
+        double limit = thread_limit();
+        if (limit <= 0) {
+            // a new window when it is limited again
+            self.n = self.idx = self.was_stopped = 0;
+            break;
+        }
+        struct sample now = {wall, now_ns(CLOCK_THREAD_CPUTIME_ID)};
+        struct sample oldest =
+            self.history[self.n < HISTORY_LEN ? 0 : self.idx];
+        struct sample prev =
+            self.history[(self.idx + HISTORY_LEN - 1) % HISTORY_LEN];
+        int had = self.n;
+        self.history[self.idx] = now;
+        self.idx = (self.idx + 1) % HISTORY_LEN;
+        if (self.n < HISTORY_LEN) {
+            self.n++;
+        }
+        if (had == 0 || now.wall <= prev.wall) {
+            break;
+        }
+
+        struct ctl_input in;
+        in.limit = limit;
+        in.usage = usage_between(&oldest, &now);
+        in.tick_usage = usage_between(&prev, &now);
+        in.was_stopped = self.was_stopped;
+        in.dt = (now.wall - prev.wall) / 1e9;
+        self.was_stopped = controller_decide(&self.controller, &in);
+        if (!self.was_stopped) {
+            break;
+        }
+        sleep_ns(interval);
+        wall = now_ns(CLOCK_MONOTONIC);
+    }
+    self.busy = 0;
+}
+
+// the cpu timer of a thread fired: it ran an interval of cpu since the
+// previous one.
+static void on_timer(int sig, siginfo_t *info, void *ucontext) {
+    int saved_errno = errno;
+    (void)sig;
+    (void)info;
+    (void)ucontext;
+    if (!running && self.has_timer) {
+        timer_delete(self.timer);
+        self.has_timer = 0;
+    }
+    self_tick(1);
+    errno = saved_errno;
+}
+
+static void thread_begin() {
+    struct sigevent sev;
+    if (!running || !conf.timer || self.has_timer) {
+        return;
+    }
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD_ID;
+    sev.sigev_signo = SELFLIMIT_SIGNAL;
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (!self.registered) {
+        // before the name is read, so a rename by the creating thread is
+        // seen either here or by pthread_setname_np()
+        self.thread = pthread_self();
+        pthread_mutex_lock(&registry_lock);
+        self.next = registry;
+        registry = &self;
+        pthread_mutex_unlock(&registry_lock);
+        self.registered = 1;
+        pthread_setspecific(exit_key, &self);
+    }
+    match_self();
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &self.timer) < 0) {
+        return;
+    }
+    self.has_timer = 1;
+    arm_timer();
+}
+
+static void thread_end(void *arg) {
+    struct self_thread **p;
+    (void)arg;
+    if (self.has_timer) {
+        timer_delete(self.timer);
+        self.has_timer = 0;
+    }
+    if (self.registered) {
+        pthread_mutex_lock(&registry_lock);
+        for (p = &registry; *p != &self; p = &(*p)->next) {
+        }
+        *p = self.next;
+        pthread_mutex_unlock(&registry_lock);
+        self.registered = 0;
+    }
+}
+
+// timers are not inherited by fork(), the child arms its own. the other
+// threads are gone, and so may be the holder of the registry lock.
+static void on_fork_child() {
+    pthread_mutex_init(&registry_lock, NULL);
+    registry = NULL;
+    self.registered = 0;
+    self.has_timer = 0;
+    thread_begin();
+}
+
+static void install() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_timer;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SELFLIMIT_SIGNAL, &sa, NULL);
+    pthread_key_create(&exit_key, thread_end);
+    pthread_atfork(NULL, NULL, on_fork_child);
+}
+
+struct start_arg {
+    void *(*start)(void *);
+    void *arg;
+};
+
+static void *thread_start(void *p) {
+    struct start_arg sa = *(struct start_arg *)p;
+    free(p);
+    thread_begin();
+    return sa.start(sa.arg);
+}
+
+// threads created while limiting get a timer before their start routine.
+API int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+                       void *(*start)(void *), void *arg) {
+    static int (*real_create)(pthread_t *, const pthread_attr_t *,
+                              void *(*)(void *), void *);
+    if (real_create == NULL) {
+        *(void **)&real_create = dlsym(RTLD_NEXT, "pthread_create");
+        if (real_create == NULL) {
+            return EAGAIN;
+        }
+    }
+    struct start_arg *sa = running && conf.timer ? malloc(sizeof(*sa)) : NULL;
+    if (sa == NULL) {
+        return real_create(thread, attr, start, arg);
+    }
+    sa->start = start;
+    sa->arg = arg;
+    int ret = real_create(thread, attr, thread_start, sa);
+    if (ret != 0) {
+        free(sa);
+    }
+    return ret;
+}
+
+// names set by another thread reach the match of a thread with a timer.
+API int pthread_setname_np(pthread_t thread, const char *name) {
+    static int (*real_setname)(pthread_t, const char *);
+    struct self_thread *st;
+    if (real_setname == NULL) {
+        *(void **)&real_setname = dlsym(RTLD_NEXT, "pthread_setname_np");
+        if (real_setname == NULL) {
+            return ENOSYS;
+        }
+    }
+    int ret = real_setname(thread, name);
+    if (ret != 0) {
+        return ret;
+    }
+    if (pthread_equal(thread, pthread_self())) {
+        match_self();
+        return 0;
+    }
+    pthread_mutex_lock(&registry_lock);
+    for (st = registry; st != NULL; st = st->next) {
+        if (pthread_equal(st->thread, thread)) {
+            st->match = name_matches(name);
+            st->match_generation = generation;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+API int selflimit_start(const struct selflimit_conf *c) {
+    struct controller_conf next;
+    struct self_thread *st;
+    char name[17];
+    if (c->percent <= 0 || c->interval_ms <= 0 ||
+        controller_parse(&next, c->controller) < 0) {
+        return -1;
+    }
+    pthread_once(&install_once, install);
+    conf = *c;
+    controller = next;
+    generation++;
+    // conf.threads may have changed, match the threads again
+    pthread_mutex_lock(&registry_lock);
+    for (st = registry; st != NULL; st = st->next) {
+        if (pthread_getname_np(st->thread, name, sizeof(name)) == 0) {
+            st->match = name_matches(name);
+            st->match_generation = generation;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    running = 1;
+    match_self();
+    thread_begin();
+    return 0;
+}
+
+API void selflimit_stop(void) {
+    running = 0;
+    generation++;
+}
+
+API void selflimit_yield(void) {
+    if (running) {
+        if (self.match_generation != generation) {
+            match_self();
+        }
+        self_tick(0);
+    }
+}
+
+API void selflimit_thread_percent(double percent) {
+    self.percent = percent;
+    self.generation = 0;
+}
+
+struct env_conf {
+    long long percent;
+    long interval_ms;
+    char controller[SELFLIMIT_MAX_SPEC];
+    char threads[SELFLIMIT_MAX_SPEC];
+    long timer;
+};
+
+// preloaded or linked in, start when the environment asks for a limit.
+__attribute__((constructor)) static void selflimit_init() {
+    struct env_conf ec;
+    struct selflimit_conf c;
+    parse_command_t cmds[] = {
+        {"CPU_LIMIT_SELF_PERCENT", conf_parse_decimal_as_milli, &ec.percent,
+         sizeof(ec.percent), "0", VT_INT,
+         "limit of every thread in percent of one cpu"},
+        {"CPU_LIMIT_SELF_INTERVAL_MS", conf_parse_integer, &ec.interval_ms,
+         sizeof(ec.interval_ms), "10", VT_INT, "tick length"},
+        {"CPU_LIMIT_SELF_CONTROLLER", conf_parse_string, ec.controller,
+         sizeof(ec.controller), "threshold", VT_STR, "control law"},
+        {"CPU_LIMIT_SELF_THREADS", conf_parse_string, ec.threads,
+         sizeof(ec.threads), "", VT_STR, "glob of thread names to limit"},
+        {"CPU_LIMIT_SELF_TIMER", conf_parse_bool, &ec.timer, sizeof(ec.timer),
+         "yes", VT_INT, "a cpu timer makes sleeps without selflimit_yield()"},
+        CONF_CMD_END(),
+    };
+
+    if (getenv("CPU_LIMIT_SELF_PERCENT") == NULL) {
+        return;
+    }
+    if (conf_init(cmds) < 0 || conf_parse_env(cmds) < 0) {
+        fprintf(stderr, "selflimit: invalid environment, not limiting\n");
+        return;
+    }
+    memset(&c, 0, sizeof(c));
+    c.percent = ec.percent / 1000.0;
+    c.interval_ms = ec.interval_ms;
+    c.timer = ec.timer;
+    snprintf(c.controller, sizeof(c.controller), "%s", ec.controller);
+    snprintf(c.threads, sizeof(c.threads), "%s", ec.threads);
+    if (selflimit_start(&c) < 0) {
+        fprintf(stderr, "selflimit: invalid limit, not limiting\n");
+    }
+}
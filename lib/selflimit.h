@@ -0,0 +1,71 @@
+/**
+ * @file selflimit.h
+ * @brief cooperative cpu limit of the threads of the calling process.
+ *
+ * libselflimit runs the controllers of cpu_limit_run inside the limited
+ * process. Every thread measures its own CLOCK_THREAD_CPUTIME_ID and sleeps
+ * at safe points while it is over its limit, so a hot thread is slowed down
+ * alone and the other threads of the process keep running, without
+ * SIGSTOP or any other signal from outside.
+ *
+ * Safe points are calls to selflimit_yield() and, unless disabled, the
+ * handler of a per thread cpu timer: a thread that never calls
+ * selflimit_yield() is still limited, but may then sleep anywhere, holding
+ * its locks. Threads that do not use cpu never see the timer.
+ *
+ * Preloaded, the library starts itself when CPU_LIMIT_SELF_PERCENT is set:
+ *
+ *     LD_PRELOAD=libselflimit.so CPU_LIMIT_SELF_PERCENT=20 ./a.out
+ *
+ * CPU_LIMIT_SELF_INTERVAL_MS, CPU_LIMIT_SELF_CONTROLLER,
+ * CPU_LIMIT_SELF_THREADS and CPU_LIMIT_SELF_TIMER set the other fields of
+ * struct selflimit_conf. Linked in, selflimit_start() does the same.
+ */
+
+#ifndef SELFLIMIT_H_
+#define SELFLIMIT_H_
+
+#include <signal.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the cpu timer is delivered as this signal, the process must not use it.
+#define SELFLIMIT_SIGNAL (SIGRTMAX - 1)
+
+#define SELFLIMIT_MAX_SPEC 64
+
+struct selflimit_conf {
+    // limit of every thread in percent of one cpu
+    double percent;
+    // tick length, the longest a thread sleeps at once
+    int interval_ms;
+    // control law as given to --controller, e.g. "pid:1,0.5,0"
+    char controller[SELFLIMIT_MAX_SPEC];
+    // glob of thread names (comm) to limit, empty for all. names are
+    // matched when a thread starts and when pthread_setname_np() or
+    // selflimit_start() is called, not on renames through prctl()
+    char threads[SELFLIMIT_MAX_SPEC];
+    // make the handler of a per thread cpu timer a safe point
+    int timer;
+};
+
+// start limiting, or change the limits. threads created before the first
+// start are limited only at their selflimit_yield() calls, later ones
+// (through pthread_create) also at their timer. return 0 on success.
+int selflimit_start(const struct selflimit_conf *conf);
+// stop limiting, threads sleep no more.
+void selflimit_stop(void);
+// safe point: sleep while the calling thread is over its limit. cheap when
+// the previous tick of the thread is less than an interval ago.
+void selflimit_yield(void);
+// limit of the calling thread instead of conf->percent, 0 for no limit,
+// negative to follow conf->percent again.
+void selflimit_thread_percent(double percent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SELFLIMIT_H_ */
@@ -0,0 +1,192 @@
+/**
+ * @file budget.c
+ * @brief weighted max-min fair split of group budgets.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "budget.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "limiter.h"
+
+// a child of a group while splitting: a subgroup or a member target.
+struct budget_share {
+    int parent;
+    double demand;
+    double weight;
+    double ceiling;
+    double alloc;
+    // group index or target index
+    int idx;
+    int is_group;
+};
+
+int budget_add_group(struct budget *b, const char *path, double cap,
+                     double weight) {
+    int parent = -1;
+    const char *slash = strrchr(path, '/');
+
+    if (strlen(path) >= BUDGET_MAX_NAME || budget_find(b, path) >= 0 ||
+        cap < 0 || weight <= 0) {
+        return -1;
+    }
+    if (slash) {
+        char parent_path[BUDGET_MAX_NAME];
+        snprintf(parent_path, sizeof(parent_path), "%.*s", (int)(slash - path),
+                 path);
+        if ((parent = budget_find(b, parent_path)) < 0) {
+            return -1;
+        }
+    }
+    if (b->ngroups == b->groups_cap) {
+        int cap_n = b->groups_cap ? b->groups_cap * 2 : 8;
+        struct budget_group *groups =
+            realloc(b->groups, cap_n * sizeof(struct budget_group));
+        if (groups == NULL) {
+            return -1;
+        }
+        b->groups = groups;
+        b->groups_cap = cap_n;
+    }
+    struct budget_group *g = &b->groups[b->ngroups];
+    memset(g, 0, sizeof(*g));
+    snprintf(g->name, sizeof(g->name), "%s", path);
+    g->parent = parent;
+    g->cap = cap;
+    g->weight = weight;
+    return b->ngroups++;
+}
+
+int budget_find(const struct budget *b, const char *path) {
+    int i;
+    for (i = 0; i < b->ngroups; i++) {
+        if (strcmp(b->groups[i].name, path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void budget_free(struct budget *b) {
+    free(b->groups);
+    free(b->shares);
+    memset(b, 0, sizeof(*b));
+}
+
+// by parent, so parents are split before their children, then by demand
+// per weight, so the water filling below walks each run once.
+static int cmp_share(const void *a, const void *b) {
+    const struct budget_share *x = a, *y = b;
+    if (x->parent != y->parent) {
+        return x->parent < y->parent ? -1 : 1;
+    }
+    double dx = x->demand / x->weight, dy = y->demand / y->weight;
+    return dx < dy ? -1 : dx > dy;
+}
+
+// split total among s[0, n) sorted by demand per weight: children
+// wanting less than their weighted share get their demand, the rest is
+// split by weight among the others. what nobody wants is spread by weight
+// too, so a child may burst up to its ceiling.
+static void water_fill(struct budget_share *s, int n, double total) {
+    double wsum = 0, left = total;
+    int i;
+    for (i = 0; i < n; i++) {
+        wsum += s[i].weight;
+    }
+    double all_w = wsum;
+    for (i = 0; i < n; i++) {
+        double fair = left * s[i].weight / wsum;
+        s[i].alloc = s[i].demand < fair ? s[i].demand : fair;
+        left -= s[i].alloc;
+        wsum -= s[i].weight;
+    }
+    for (i = 0; i < n && left > 0; i++) {
+        s[i].alloc += left * s[i].weight / all_w;
+        if (s[i].alloc > s[i].ceiling) {
+            s[i].alloc = s[i].ceiling;
+        }
+    }
+}
+
+void budget_update(struct budget *b, struct limiter *l) {
+    double machine = l->capacity * 100.0;
+    int i, n = 0;
+
+    if (b->shares_cap < b->ngroups + l->ntargets) {
+        int cap = (b->ngroups + l->ntargets) * 2;
+        struct budget_share *p =
+            realloc(b->shares, cap * sizeof(struct budget_share));
+        if (p == NULL) {
+            return;
+        }
+        b->shares = p;
+        b->shares_cap = cap;
+    }
+    struct budget_share *shares = b->shares;
+    for (i = 0; i < b->ngroups; i++) {
+        b->groups[i].usage = 0;
+        b->groups[i].demand = 0;
+    }
+
+    // one pass over member samples
+    for (i = 0; i < l->ntargets; i++) {
+        struct target *t = &l->targets[i];
+        if (t->group < 0 || t->group >= b->ngroups || t->exited) {
+            continue;
+        }
+        struct budget_share *s = &shares[n++];
+        s->parent = t->group;
+        s->ceiling = t->percent < t->capacity ? t->percent : t->capacity;
+        // demand is measured while running, unknown until the target ran
+        s->demand = t->controller.demand > 0 ? t->controller.demand
+                                             : s->ceiling;
+        if (s->demand > s->ceiling) {
+            s->demand = s->ceiling;
+        }
+        s->weight = t->weight > 0 ? t->weight : 1;
+        s->idx = i;
+        s->is_group = 0;
+        b->groups[t->group].usage += t->usage;
+        b->groups[t->group].demand += s->demand;
+    }
+    // children have higher indexes, fold them into parents backwards
+    for (i = b->ngroups - 1; i >= 0; i--) {
+        struct budget_group *g = &b->groups[i];
+        struct budget_share *s = &shares[n++];
+        s->ceiling = g->cap > 0 ? g->cap : machine;
+        if (g->demand > s->ceiling) {
+            g->demand = s->ceiling;
+        }
+        s->parent = g->parent;
+        s->demand = g->demand;
+        s->weight = g->weight;
+        s->idx = i;
+        s->is_group = 1;
+        if (g->parent >= 0) {
+            b->groups[g->parent].usage += g->usage;
+            b->groups[g->parent].demand += g->demand;
+        }
+    }
+
+    qsort(shares, n, sizeof(struct budget_share), cmp_share);
+    for (i = 0; i < n;) {
+        int j = i, k;
+        while (j < n && shares[j].parent == shares[i].parent) j++;
+        int parent = shares[i].parent;
+        water_fill(&shares[i], j - i,
+                   parent < 0 ? machine : b->groups[parent].alloc);
+        for (k = i; k < j; k++) {
+            if (shares[k].is_group) {
+                b->groups[shares[k].idx].alloc = shares[k].alloc;
+            } else {
+                l->targets[shares[k].idx].budget = shares[k].alloc;
+            }
+        }
+        i = j;
+    }
+}
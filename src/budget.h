@@ -0,0 +1,61 @@
+/**
+ * @file budget.h
+ * @brief hierarchical weighted cpu budgets shared by groups of targets.
+ */
+
+#ifndef BUDGET_H_
+#define BUDGET_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct limiter;
+struct budget_share;
+
+#define BUDGET_MAX_NAME 64
+
+// a node of the budget tree, named by its path like "batch/etl". the
+// machine is the root, top level groups share the cpus we may use.
+struct budget_group {
+    char name[BUDGET_MAX_NAME];
+    // index of the parent group, -1 for top level, always lower than ours
+    int parent;
+    // most percent the group may use, 0 for no cap
+    double cap;
+    // share of the parent budget against siblings
+    double weight;
+
+    // updated every tick by budget_update()
+    double usage;
+    double demand;
+    double alloc;
+};
+
+struct budget {
+    struct budget_group *groups;
+    int ngroups, groups_cap;
+    // scratch of budget_update()
+    struct budget_share *shares;
+    int shares_cap;
+};
+
+// add group path, its parent path must be added before.
+// return index of the group, -1 on error.
+int budget_add_group(struct budget *b, const char *path, double cap,
+                     double weight);
+// index of group path, -1 if there is none.
+int budget_find(const struct budget *b, const char *path);
+void budget_free(struct budget *b);
+
+// sum usage and demand of member targets into their groups in one pass,
+// then split every budget among children by weight, children using less
+// than their share give the rest to busier siblings. the result is put in
+// target->budget of members.
+void budget_update(struct budget *b, struct limiter *l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BUDGET_H_ */
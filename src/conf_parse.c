@@ -3,12 +3,21 @@
  * @brief 配置项解析函数实现.
  */
 
+#define _GNU_SOURCE
+
 #include "conf_parse.h"
 
 #include <ctype.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
+
+/// include 最大嵌套深度
+#define CONF_MAX_INCLUDE 16
 
 /**
  * @brief 16进制辅助函数，将16进制字符转换为整数值.
@@ -96,7 +105,11 @@ int conf_parse_bool(void *addr, size_t addr_cap, void *value,
 int conf_parse_string(void *addr, size_t addr_cap, void *value,
                       size_t value_len) {
     char *dest = (char *)addr, *src = (char *)value;
-    int len = addr_cap < value_len ? addr_cap : value_len;
+    if (addr_cap == 0) {
+        return -1;
+    }
+    // keep one byte for '\0'
+    size_t len = addr_cap - 1 < value_len ? addr_cap - 1 : value_len;
     while (len-- && *src) {
         *dest++ = *src++;
     }
@@ -209,6 +222,42 @@ int conf_parse_time_as_second(void *addr, size_t addr_cap, void *value,
     return 0;
 }
 
+int conf_parse_decimal_as_milli(void *addr, size_t addr_cap, void *value,
+                                size_t value_len) {
+    int i;
+    char *p = (char *)value;
+    long long int milli = 0, scale = 1000;
+    int frac = 0, round = 0;
+
+    for (i = 0; i < (int)value_len && *p; i++, p++) {
+        char c = *p;
+        if (c == '.' && !frac) {
+            frac = 1;
+        } else if (isdigit(c) && !frac) {
+            milli = milli * 10 + (c - '0') * 1000;
+        } else if (isdigit(c) && scale > 1) {
+            scale /= 10;
+            milli += (c - '0') * scale;
+        } else if (isdigit(c)) {
+            // 第四位小数四舍五入
+            round = round || (c >= '5' && scale == 1);
+            scale = 0;
+        } else if (c != '%' && c != ' ') {
+            printf("conf_parse_decimal_as_milli invalid value: %s\n",
+                   (char *)value);
+            return -1;
+        }
+    }
+    milli += round;
+
+    if (put_integer2addr(addr, addr_cap, milli) < 0) {
+        printf("conf_parse_decimal_as_milli invalid addr_cap: %ld\n",
+               (long)addr_cap);
+        return -1;
+    }
+    return 0;
+}
+
 int conf_do_include(void *addr, size_t addr_cap, void *value,
                     size_t value_len) {
     (void)addr_cap;
@@ -219,185 +268,317 @@ int conf_do_include(void *addr, size_t addr_cap, void *value,
     return conf_parse_file(addr, value);
 }
 
+int conf_init(parse_command_t *const cmds) {
+    parse_command_t *it = cmds;
+    for (it = cmds; it->cmd; it++) {
+        size_t slen = 0;
+        if (it->default_value_string) {
+            slen = strlen(it->default_value_string);
+        }
+        if (it->parse_func(it->addr, it->addr_cap, it->default_value_string,
+                           slen) < 0) {
+            printf("default conf error: key=%s, value=%s\n", it->cmd,
+                   it->default_value_string);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /**
- * @brief 解析一行配置文件
+ * @brief key 的 FNV-1a 哈希，'-' 和 '.' 按 '_' 计算
  */
-static int conf_parse_line(parse_command_t *const cmds, const char *const line,
-                           size_t line_len, const char *const confile,
-                           size_t line_num) {
-    static char key[CONF_MAX_LINE_LEN], value[CONF_MAX_LINE_LEN];
-    char *pkey, *pvalue;
-    size_t keylen = 0, valuelen = 0;
-    char const *p = line;
-
-    if (line_len == 0) {
-        return 0;
+static size_t hash_key(const char *key, size_t len) {
+    size_t i, h = 2166136261u;
+    for (i = 0; i < len; i++) {
+        char c = key[i] == '-' || key[i] == '.' ? '_' : key[i];
+        h = (h ^ (unsigned char)c) * 16777619u;
     }
+    return h;
+}
 
-    // skip spaces
-    while (*p && (*p == ' ' || *p == '\t')) p++;
-    if (!*p) {
-        printf("invalid conf at file %s, line %ld - %s\n", confile,
-               (long)line_num, line);
+/**
+ * @brief 命令名 cmd 是否等于长度为 len 的 key
+ */
+static int key_equal(const char *cmd, const char *key, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        char c = key[i] == '-' || key[i] == '.' ? '_' : key[i];
+        if (cmd[i] != c) {
+            return 0;
+        }
+    }
+    return cmd[len] == '\0';
+}
+
+int conf_ctx_init(conf_ctx_t *ctx, parse_command_t *const cmds) {
+    size_t n = 0, nslots = 16, i;
+    parse_command_t *it;
+    memset(ctx, 0, sizeof(*ctx));
+    for (it = cmds; it->cmd; it++) {
+        n++;
+    }
+    // 装载因子不超过一半
+    while (nslots < n * 2) {
+        nslots *= 2;
+    }
+    ctx->slots = calloc(nslots, sizeof(int));
+    ctx->next = calloc(n + 1, sizeof(int));
+    if (ctx->slots == NULL || ctx->next == NULL) {
+        conf_ctx_free(ctx);
         return -1;
     }
+    ctx->cmds = cmds;
+    ctx->mask = nslots - 1;
+    for (i = 0; i < n; i++) {
+        size_t len = strlen(cmds[i].cmd);
+        size_t slot = hash_key(cmds[i].cmd, len) & ctx->mask;
+        parse_command_t *it = conf_ctx_find(ctx, cmds[i].cmd, len);
+        // 同名命令索引第一个，其余挂在它的链尾，和逐个比较时一样都被调用
+        if (it) {
+            while (ctx->next[it - cmds]) {
+                it = &cmds[ctx->next[it - cmds] - 1];
+            }
+            ctx->next[it - cmds] = i + 1;
+            continue;
+        }
+        while (ctx->slots[slot]) {
+            slot = (slot + 1) & ctx->mask;
+        }
+        ctx->slots[slot] = i + 1;
+    }
+    return 0;
+}
+
+void conf_ctx_free(conf_ctx_t *ctx) {
+    free(ctx->slots);
+    free(ctx->next);
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+parse_command_t *conf_ctx_find(const conf_ctx_t *ctx, const char *key,
+                               size_t key_len) {
+    size_t slot = hash_key(key, key_len) & ctx->mask;
+    while (ctx->slots[slot]) {
+        parse_command_t *it = &ctx->cmds[ctx->slots[slot] - 1];
+        if (key_equal(it->cmd, key, key_len)) {
+            return it;
+        }
+        slot = (slot + 1) & ctx->mask;
+    }
+    return NULL;
+}
+
+parse_command_t *conf_ctx_next(const conf_ctx_t *ctx, parse_command_t *it) {
+    int next = ctx->next[it - ctx->cmds];
+    return next ? &ctx->cmds[next - 1] : NULL;
+}
 
+/**
+ * @brief 解析 [line, end) 一行，key 和值就地以 '\0' 结尾
+ */
+static int conf_ctx_parse_line(conf_ctx_t *ctx, char *line, char *end,
+                               const char *name, size_t line_num) {
+    char *p = line, *key, *value, *value_end;
+
+    // skip spaces
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
     // command out line
-    if (*p == '#' || *p == '\r' || *p == '\n' || *p == '[') {
+    if (p == end || *p == '#' || *p == '\r' || *p == '[') {
         return 0;
     }
 
     // find key
-    pkey = key;
-    while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
-        *pkey++ = *p++;
-        keylen++;
-    }
-    *pkey = '\0';
+    key = p;
+    while (p < end && *p != ' ' && *p != '\t' && *p != '\r') p++;
+    size_t keylen = p - key;
 
     // skip spaces, value may empty
-    while (*p && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
-
-    // set value
-    pvalue = value;
-    while (*p && *p != '\r' && *p != '\n') {
-        *pvalue++ = *p++;
-        valuelen++;
-    }
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    value = p;
+    value_end = end;
     // trim valuestring
-    while (pvalue > value && (*(pvalue - 1) == ' ' || *(pvalue - 1) == '\t')) {
-        pvalue--;
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t' ||
+            value_end[-1] == '\r')) {
+        value_end--;
     }
-    *pvalue = '\0';
 
-    // call parse_fn
-    parse_command_t *it = cmds;
-    for (it = cmds; it->cmd; it++) {
-        if (strcmp(it->cmd, key) == 0) {
-            if (it->parse_func(it->addr, it->addr_cap, value, valuelen) < 0) {
-                printf(
-                    "parsefunc return error, cmd %s, file %s, line %ld - %s\n",
-                    it->cmd, confile, (long)line_num, line);
-                return -1;
-            }
+    parse_command_t *it = conf_ctx_find(ctx, key, keylen);
+    if (it == NULL) {
+        return 0;
+    }
+    key[keylen] = '\0';
+    *value_end = '\0';
+    if (it->parse_func == conf_do_include) {
+        // 同一个上下文解析被 include 的文件
+        return value == value_end ? 0 : conf_ctx_parse_file(ctx, value);
+    }
+    for (; it; it = conf_ctx_next(ctx, it)) {
+        if (it->parse_func(it->addr, it->addr_cap, value, value_end - value) <
+            0) {
+            printf("parsefunc return error, cmd %s, file %s, line %ld - %s\n",
+                   it->cmd, name, (long)line_num, value);
+            return -1;
         }
     }
-
     return 0;
 }
 
-int conf_init(parse_command_t *const cmds) {
-    parse_command_t *it = cmds;
-    for (it = cmds; it->cmd; it++) {
-        size_t slen = 0;
-        if (it->default_value_string) {
-            slen = strlen(it->default_value_string);
-        }
-        if (it->parse_func(it->addr, it->addr_cap, it->default_value_string,
-                           slen) < 0) {
-            printf("default conf error: key=%s, value=%s\n", it->cmd,
-                   it->default_value_string);
+int conf_ctx_parse_buffer(conf_ctx_t *ctx, char *buf, size_t len,
+                          const char *name) {
+    char *p = buf, *end = buf + len;
+    size_t line_num = 0;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        char *line_end = nl ? nl : end;
+        line_num++;
+        if (conf_ctx_parse_line(ctx, p, line_end, name, line_num) < 0) {
+            printf("parse conf %s failed\n", name);
             return -1;
         }
+        p = line_end + 1;
     }
     return 0;
 }
 
-int conf_parse_file(parse_command_t *const cmds, char const *const confile) {
-    FILE *f = NULL;
-    static char line[CONF_MAX_LINE_LEN];
+/**
+ * @brief 读取文件到堆上的 *buf，末尾留一个字节. size_hint 为预计大小,
+ * 文件在读的过程中变短变长都只影响读到的内容
+ */
+static ssize_t read_all(int fd, size_t size_hint, char **buf) {
+    size_t cap = size_hint + 1 > 4096 ? size_hint + 1 : 4096, len = 0;
+    ssize_t n;
+    *buf = malloc(cap);
+    while (*buf) {
+        if (len + 1 == cap) {
+            char *next = realloc(*buf, cap * 2);
+            if (next == NULL) {
+                break;
+            }
+            *buf = next;
+            cap *= 2;
+        }
+        n = read(fd, *buf + len, cap - 1 - len);
+        if (n <= 0) {
+            return n < 0 ? -1 : (ssize_t)len;
+        }
+        len += n;
+    }
+    free(*buf);
+    *buf = NULL;
+    return -1;
+}
+
+int conf_ctx_parse_file(conf_ctx_t *ctx, char const *const confile) {
+    struct stat st;
+    int ret;
 
-    if (cmds == NULL || confile == NULL) {
+    if (ctx == NULL || confile == NULL || ctx->depth >= CONF_MAX_INCLUDE) {
         return -1;
     }
-
-    f = fopen(confile, "r");
-    if (f == NULL) {
+    int fd = open(confile, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         return -1;
     }
-
-    int line_num = 0;
-    while (fgets(line, sizeof(line), f)) {
-        if (conf_parse_line(cmds, line, strlen(line), confile, line_num) < 0) {
-            printf("parse conf %s failed\n", confile);
-            fclose(f);
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    ctx->depth++;
+    // 只 mmap 不会再变的文件 (封住写和截短的 memfd). 普通文件可能正被编辑器
+    // 改写，截短后访问映射会 SIGBUS，所以读到堆上
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_WRITE) && (seals & F_SEAL_SHRINK) &&
+        st.st_size > 0) {
+        // 匿名映射多留一个字节给最后一行的 '\0'，文件映射覆盖在它前面
+        size_t len = st.st_size;
+        char *buf = mmap(NULL, len + 1, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED ||
+            mmap(buf, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 fd, 0) == MAP_FAILED) {
+            if (buf != MAP_FAILED) {
+                munmap(buf, len + 1);
+            }
+            ctx->depth--;
+            close(fd);
             return -1;
         }
-    }
-
-    fclose(f);
-    return 0;
+        close(fd);
+        madvise(buf, len, MADV_SEQUENTIAL);
+        ret = conf_ctx_parse_buffer(ctx, buf, len, confile);
+        munmap(buf, len + 1);
+    } else {
+        char *buf;
+        ssize_t len =
+            read_all(fd, S_ISREG(st.st_mode) ? (size_t)st.st_size : 0, &buf);
+        close(fd);
+        ret = len < 0 ? -1 : conf_ctx_parse_buffer(ctx, buf, len, confile);
+        free(buf);
+    }
+    ctx->depth--;
+    return ret;
 }
 
-int conf_parse_key_value_arg(parse_command_t *const cmds, const char *key,
-                             const char *value, const char *whatarg) {
-    parse_command_t *it = cmds;
-    for (it = cmds; it->cmd; it++) {
-        if (strcmp(it->cmd, key) == 0) {
-            if (it->parse_func(it->addr, it->addr_cap, (char *)value,
-                               strlen(value)) < 0) {
-                printf("parsefunc return error, cmd %s, arg %s\n", it->cmd,
-                       whatarg);
-                return -1;
-            }
-        }
+int conf_parse_file(parse_command_t *const cmds, char const *const confile) {
+    conf_ctx_t ctx;
+    if (cmds == NULL || confile == NULL || conf_ctx_init(&ctx, cmds) < 0) {
+        return -1;
     }
-    return 0;
+    int ret = conf_ctx_parse_file(&ctx, confile);
+    conf_ctx_free(&ctx);
+    return ret;
 }
 
-static void convert_key_underscore(char *key, int len) {
-    int i;
-    for (i = 0; i < len; i++) {
-        if (key[i] == '-' || key[i] == '.') {
-            key[i] = '_';
+/**
+ * @brief 解析一个命令行参数，未知参数忽略
+ */
+static void conf_ctx_parse_arg(conf_ctx_t *ctx, const char *key,
+                               size_t key_len, const char *value,
+                               const char *whatarg) {
+    parse_command_t *it = conf_ctx_find(ctx, key, key_len);
+    for (; it; it = conf_ctx_next(ctx, it)) {
+        if (it->parse_func(it->addr, it->addr_cap, (char *)value,
+                           strlen(value)) < 0) {
+            printf("parsefunc return error, cmd %s, arg %s\n", it->cmd,
+                   whatarg);
         }
     }
 }
 
-int conf_parse_args(parse_command_t *const cmds, int argc, char const *argv[]) {
+int conf_ctx_parse_args(conf_ctx_t *ctx, int argc, char const *argv[]) {
     int i;
-    static char key[CONF_MAX_LINE_LEN], value[CONF_MAX_LINE_LEN];
-    int minlen = 0;
-
     for (i = 1; i < argc; ++i) {
         if (strlen(argv[i]) > 2 && argv[i][0] == '-' && argv[i][1] == '-') {
-            const char *line_p = &argv[i][2];
-            char *eqindex = strchr(line_p, '=');
+            // foo-bar, foo.bar same as foo_bar
+            const char *key = &argv[i][2];
+            const char *eqindex = strchr(key, '=');
             if (eqindex != NULL) {
-                minlen = eqindex - line_p;
-                if (minlen > CONF_MAX_LINE_LEN) {
-                    minlen = CONF_MAX_LINE_LEN;
-                }
-                strncpy(key, line_p, CONF_MAX_LINE_LEN);
-                // foo-bar, foo.bar same as foo_bar
-                convert_key_underscore(key, minlen);
-                minlen = strlen(line_p) - minlen /*key*/ - 1 /*=*/;
-                if (minlen > CONF_MAX_LINE_LEN) {
-                    minlen = CONF_MAX_LINE_LEN;
-                }
-                strncpy(value, eqindex + 1, CONF_MAX_LINE_LEN);
-                conf_parse_key_value_arg(cmds, key, value, argv[i]);
+                conf_ctx_parse_arg(ctx, key, eqindex - key, eqindex + 1,
+                                   argv[i]);
                 continue;
             }
             if (i + 1 == argc) {
                 return 0;
             }
-            minlen = strlen(&argv[i][2]) - 2;
-            if (minlen > CONF_MAX_LINE_LEN) {
-                minlen = CONF_MAX_LINE_LEN;
-            }
-            // foo-bar, foo.bar same as foo_bar
-            convert_key_underscore(key, minlen);
-
-            strncpy(key, &argv[i][2], CONF_MAX_LINE_LEN);
-            conf_parse_key_value_arg(cmds, key, argv[i + 1], argv[i]);
+            conf_ctx_parse_arg(ctx, key, strlen(key), argv[i + 1], argv[i]);
             ++i;
         }
     }
-
     return 0;
 }
 
+int conf_parse_args(parse_command_t *const cmds, int argc, char const *argv[]) {
+    conf_ctx_t ctx;
+    if (conf_ctx_init(&ctx, cmds) < 0) {
+        return -1;
+    }
+    int ret = conf_ctx_parse_args(&ctx, argc, argv);
+    conf_ctx_free(&ctx);
+    return ret;
+}
+
 int conf_parse_env(parse_command_t *const cmds) {
     parse_command_t *it = cmds;
     for (it = cmds; it->cmd; it++) {
@@ -422,6 +603,7 @@ int conf_print_conf(FILE *out, parse_command_t *cmds) {
         } else if (it->parse_func == conf_parse_integer ||
                    it->parse_func == conf_parse_bool ||
                    it->parse_func == conf_parse_memspace_as_bytes ||
+                   it->parse_func == conf_parse_decimal_as_milli ||
                    it->parse_func == conf_parse_time_as_second) {
             long long int value = 0;
             if (it->addr_cap == 1) {
@@ -463,6 +645,8 @@ void conf_print_usage(FILE *out, parse_command_t *cmds) {
             fprintf(out, "SPACE(example:1g3k/5m/20k/100B...)\t");
         } else if (it->parse_func == conf_parse_time_as_second) {
             fprintf(out, "DURATION(example:3y10d10h6m10s/10h)\t");
+        } else if (it->parse_func == conf_parse_decimal_as_milli) {
+            fprintf(out, "DECIMAL(example:2.5/12.5%%/0.125)\t");
         } else if (it->parse_func == conf_parse_string) {
             fprintf(out, "STRING(example:this-is-string)\t");
         } else if (it->parse_func == conf_do_include) {
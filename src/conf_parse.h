@@ -42,6 +42,10 @@ int conf_parse_memspace_as_bytes(void *addr, size_t addr_cap, void *value,
 /// value 可以有单位 s, m, h, d, y.
 int conf_parse_time_as_second(void *addr, size_t addr_cap, void *value,
                               size_t value_len);
+/// 解析配置值 value 到整数 addr，单位为千分之一.
+/// value 可以有小数和后缀 %, 例如 2.5 解析为 2500, 12.125% 解析为 12125.
+int conf_parse_decimal_as_milli(void *addr, size_t addr_cap, void *value,
+                                size_t value_len);
 /// 遇到配置项 "include=filename"，就直接打开文件 filename 解析它
 int conf_do_include(void *addr, size_t addr_cap, void *value, size_t value_len);
 /// 解析 true, false, ok, yes, no, 1 到整数
@@ -89,6 +93,60 @@ int conf_parse_file(parse_command_t *const cmds, char const *const confile);
  */
 int conf_parse_args(parse_command_t *const cmds, int argc, char const *argv[]);
 
+/**
+ * @brief 解析上下文. 建立一次命令的哈希索引，之后可反复解析文件、命令行，
+ * 所有状态都在上下文里，没有静态缓冲区，不同上下文可以在不同线程并行使用.
+ */
+typedef struct _conf_ctx_t {
+    parse_command_t *cmds;
+    /// 开放寻址哈希表，存命令下标 + 1，0 为空槽
+    int *slots;
+    size_t mask;
+    /// 同名命令的链，存下一个同名命令的下标 + 1，0 为没有
+    int *next;
+    /// include 嵌套深度，防止循环 include
+    int depth;
+} conf_ctx_t;
+
+/**
+ * @brief 为 cmds 建立哈希索引. key 中的 '-' 和 '.' 等同于 '_'.
+ *
+ * @param ctx 调用方提供的上下文
+ * @param cmds parse_command_t 数组，最后一个对象所以值应为 0
+ * @return int 成功返回 0
+ */
+int conf_ctx_init(conf_ctx_t *ctx, parse_command_t *const cmds);
+/// 释放哈希索引
+void conf_ctx_free(conf_ctx_t *ctx);
+/// 查找长度为 key_len 的 key 对应的命令，没有返回 NULL
+parse_command_t *conf_ctx_find(const conf_ctx_t *ctx, const char *key,
+                               size_t key_len);
+/// 同名的下一个命令，没有返回 NULL. 同名命令按数组顺序都会被解析
+parse_command_t *conf_ctx_next(const conf_ctx_t *ctx, parse_command_t *it);
+/**
+ * @brief 解析内存中的配置内容. 每行的 key 和值在 buf 中就地以 '\0' 结尾，
+ * 不复制行，行长度不受 CONF_MAX_LINE_LEN 限制.
+ *
+ * @param ctx 上下文
+ * @param buf 配置内容，会被修改，buf[len] 必须可写
+ * @param len 内容长度
+ * @param name 出错时打印的文件名
+ * @return int 成功返回 0
+ */
+int conf_ctx_parse_buffer(conf_ctx_t *ctx, char *buf, size_t len,
+                          const char *name);
+/**
+ * @brief 读取并解析配置文件. 普通文件整个读到堆上，解析中被截短也不会
+ * SIGBUS; 封住写和截短的 memfd 才用私有写时复制映射.
+ *
+ * @param ctx 上下文
+ * @param confile 配置文件路径
+ * @return int 成功返回 0
+ */
+int conf_ctx_parse_file(conf_ctx_t *ctx, char const *const confile);
+/// 同 conf_parse_args，使用 ctx 的索引
+int conf_ctx_parse_args(conf_ctx_t *ctx, int argc, char const *argv[]);
+
 /**
  * @brief 将环境变量解析到配置项. 忽略大小写，环境变量通常是全大写的。
  *
@@ -140,6 +198,9 @@ long long get_int_from_addr(void *addr, size_t addr_cap);
              desc)
 #define CONF_CMD_TIME(conf, key, default_value, desc) \
     CONF_CMD(conf, key, conf_parse_time_as_second, default_value, VT_INT, desc)
+#define CONF_CMD_MILLI(conf, key, default_value, desc)                      \
+    CONF_CMD(conf, key, conf_parse_decimal_as_milli, default_value, VT_INT, \
+             desc)
 #define CONF_CMD_BOOL(conf, key, default_value, desc) \
     CONF_CMD(conf, key, conf_parse_bool, default_value, VT_INT, desc)
 
@@ -0,0 +1,364 @@
+/**
+ * @file control.c
+ * @brief control socket commands of a running limiter.
+ */
+
+#define _GNU_SOURCE
+
+#include "control.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "budget.h"
+#include "metrics.h"
+
+int control_open(struct control *c, const char *path) {
+    struct sockaddr_un addr;
+
+    memset(c, 0, sizeof(*c));
+    c->listen_fd = -1;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "control socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "socket() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    // stale socket of a previous run
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, CONTROL_MAX_CLIENTS) < 0) {
+        fprintf(stderr, "bind(%s) failed: %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    c->listen_fd = fd;
+    snprintf(c->path, sizeof(c->path), "%s", path);
+    return 0;
+}
+
+void control_close(struct control *c) {
+    int i;
+    for (i = 0; i < c->nclients; i++) {
+        close(c->clients[i].fd);
+        free(c->clients[i].out);
+    }
+    c->nclients = 0;
+    if (c->listen_fd >= 0) {
+        close(c->listen_fd);
+        unlink(c->path);
+    }
+    c->listen_fd = -1;
+}
+
+// apply fn to target pid, or every target when which is "all".
+// return number of targets matched.
+static int for_targets(struct limiter *l, const char *which,
+                       void (*fn)(struct limiter *, struct target *, double),
+                       double arg) {
+    int i, n = 0;
+    int all = strcmp(which, "all") == 0;
+    int pid = atoi(which);
+    for (i = 0; i < l->ntargets; i++) {
+        struct target *t = &l->targets[i];
+        if (!t->exited && (all || t->pid == pid)) {
+            fn(l, t, arg);
+            n++;
+        }
+    }
+    return n;
+}
+
+static void set_percent(struct limiter *l, struct target *t, double percent) {
+    (void)l;
+    t->percent = percent;
+}
+
+static void set_paused(struct limiter *l, struct target *t, double paused) {
+    (void)l;
+    t->paused = paused != 0;
+}
+
+static void print_status(struct limiter *l, FILE *out) {
+    int i, j;
+    fprintf(out, "interval_ms %ld\n", l->interval_ms);
+    for (i = 0; i < l->ntargets; i++) {
+        struct target *t = &l->targets[i];
+        fprintf(out,
+                "pid %d percent %.3f usage %.2f stopped %d paused %d exited %d "
+                "stops %ld conts %ld soft %d\n",
+                t->pid, t->percent, t->usage, t->is_stop, t->paused, t->exited,
+                t->nstop, t->ncont, t->soft_level);
+        if (t->io_read_limit || t->io_write_limit) {
+            fprintf(out,
+                    "pid %d read_bps %.0f write_bps %.0f stops_cpu %ld "
+                    "stops_io_read %ld stops_io_write %ld\n",
+                    t->pid, t->read_rate, t->write_rate, t->nstop_cpu,
+                    t->nstop_io_read, t->nstop_io_write);
+        }
+        for (j = 0; j < t->nhorizons; j++) {
+            struct horizon *h = &t->horizons[j];
+            fprintf(out, "pid %d horizon %gs limit %.2f usage %.2f stops %ld\n",
+                    t->pid, h->conf.window_ns / 1e9, h->conf.limit,
+                    horizon_share(h) * 100 * l->nproc, h->nstop);
+        }
+        if (t->group >= 0 && l->budget) {
+            fprintf(out, "pid %d group %s weight %.2f budget %.2f\n", t->pid,
+                    l->budget->groups[t->group].name, t->weight, t->budget);
+        }
+    }
+    for (i = 0; l->budget && i < l->budget->ngroups; i++) {
+        struct budget_group *g = &l->budget->groups[i];
+        fprintf(out, "group %s cap %.2f weight %.2f usage %.2f budget %.2f\n",
+                g->name, g->cap, g->weight, g->usage, g->alloc);
+    }
+}
+
+static const char *policy_name(int policy) {
+    switch (policy) {
+        case SCHED_OTHER:
+            return "other";
+        case SCHED_BATCH:
+            return "batch";
+        case SCHED_IDLE:
+            return "idle";
+        case SCHED_FIFO:
+            return "fifo";
+        case SCHED_RR:
+            return "rr";
+    }
+    return "unknown";
+}
+
+static int cmp_usage_desc(const void *a, const void *b) {
+    double x = ((const struct thread_stat *)a)->usage;
+    double y = ((const struct thread_stat *)b)->usage;
+    return x > y ? -1 : x < y;
+}
+
+// threads of t from the last scan, hottest first.
+static void print_threads(struct target *t, FILE *out) {
+    int i, n = t->threads.nthreads;
+    struct thread_stat *sorted = malloc(n * sizeof(struct thread_stat) + 1);
+    if (sorted == NULL) {
+        return;
+    }
+    memcpy(sorted, t->threads.threads, n * sizeof(struct thread_stat));
+    qsort(sorted, n, sizeof(struct thread_stat), cmp_usage_desc);
+    for (i = 0; i < n; i++) {
+        struct thread_stat *ts = &sorted[i];
+        fprintf(out, "pid %d tid %d comm %s usage %.2f policy %s matched %d\n",
+                ts->pid, ts->tid, ts->comm, ts->usage,
+                policy_name(ts->policy), ts->matched);
+    }
+    free(sorted);
+}
+
+// run one command line, reply is written to out.
+static void run_command(struct limiter *l, char *line, FILE *out) {
+    char cmd[32], a[32], b[32];
+    double v;
+    int n = sscanf(line, "%31s %31s %31s %lf", cmd, a, b, &v);
+
+    if (n >= 1 && strcmp(cmd, "status") == 0) {
+        print_status(l, out);
+    } else if (n >= 1 && strcmp(cmd, "metrics") == 0) {
+        metrics_write(l, out);
+    } else if (n == 3 && strcmp(cmd, "set") == 0 &&
+               strcmp(a, "interval") == 0) {
+        long ms = atol(b);
+        if (ms <= 0) {
+            fprintf(out, "error interval must larger then 0\n");
+            return;
+        }
+        l->interval_ms = ms;
+    } else if (n == 4 && strcmp(cmd, "set") == 0 &&
+               (strcmp(b, "percent") == 0 || strcmp(b, "cores") == 0)) {
+        if (v <= 0) {
+            fprintf(out, "error %s must larger then 0\n", b);
+            return;
+        }
+        if (strcmp(b, "cores") == 0) {
+            v *= 100;
+        }
+        if (for_targets(l, a, set_percent, v) == 0) {
+            fprintf(out, "error no such target %s\n", a);
+            return;
+        }
+    } else if (n == 2 && strcmp(cmd, "threads") == 0) {
+        int i, found = 0;
+        if (l->threads_interval_ns == 0) {
+            fprintf(out, "error threads are not scanned, see --threads-ms\n");
+            return;
+        }
+        for (i = 0; i < l->ntargets; i++) {
+            struct target *t = &l->targets[i];
+            if (!t->exited &&
+                (strcmp(a, "all") == 0 || t->pid == atoi(a))) {
+                print_threads(t, out);
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(out, "error no such target %s\n", a);
+            return;
+        }
+    } else if (n == 2 && (strcmp(cmd, "pause") == 0 ||
+                          strcmp(cmd, "resume") == 0)) {
+        if (for_targets(l, a, set_paused, strcmp(cmd, "pause") == 0) == 0) {
+            fprintf(out, "error no such target %s\n", a);
+            return;
+        }
+    } else {
+        fprintf(out, "error unknown command\n");
+        return;
+    }
+    fprintf(out, "ok\n");
+}
+
+static void drop_client(struct control *c, int i) {
+    close(c->clients[i].fd);
+    free(c->clients[i].out);
+    c->clients[i] = c->clients[--c->nclients];
+}
+
+// queue reply after the pending ones of cl, return -1 if out of memory.
+static int queue_reply(struct control_client *cl, const char *reply,
+                       size_t len) {
+    if (cl->out_len + len > cl->out_cap) {
+        size_t cap = cl->out_cap ? cl->out_cap : 4096;
+        while (cap < cl->out_len + len) {
+            cap *= 2;
+        }
+        char *next = realloc(cl->out, cap);
+        if (next == NULL) {
+            return -1;
+        }
+        cl->out = next;
+        cl->out_cap = cap;
+    }
+    memcpy(cl->out + cl->out_len, reply, len);
+    cl->out_len += len;
+    return 0;
+}
+
+// send what the socket takes of the pending replies, return -1 if the
+// client is gone. MSG_NOSIGNAL: a client that closed must not raise
+// SIGPIPE, which would kill the limiter and leave its targets stopped.
+static int flush_client(struct control_client *cl) {
+    size_t sent = 0;
+    while (sent < cl->out_len) {
+        ssize_t n = send(cl->fd, cl->out + sent, cl->out_len - sent,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        sent += n;
+    }
+    cl->out_len -= sent;
+    memmove(cl->out, cl->out + sent, cl->out_len);
+    return 0;
+}
+
+// read from client i and run every complete line, return -1 if it closed.
+static int serve_client(struct control *c, struct limiter *l, int i,
+                        short revents) {
+    struct control_client *cl = &c->clients[i];
+    if (cl->out_len > 0) {
+        // POLLIN is not asked for until the pending replies are sent
+        return flush_client(cl);
+    }
+    if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+        return 0;
+    }
+    ssize_t n = read(cl->fd, cl->buf + cl->len, sizeof(cl->buf) - 1 - cl->len);
+    if (n <= 0) {
+        return n < 0 && errno == EAGAIN ? 0 : -1;
+    }
+    cl->len += n;
+    cl->buf[cl->len] = '\0';
+
+    char *line = cl->buf, *nl;
+    while ((nl = strchr(line, '\n')) != NULL) {
+        char *reply = NULL;
+        size_t reply_len = 0;
+        *nl = '\0';
+        FILE *out = open_memstream(&reply, &reply_len);
+        if (out == NULL) {
+            return -1;
+        }
+        run_command(l, line, out);
+        fclose(out);
+        int ret = queue_reply(cl, reply, reply_len);
+        free(reply);
+        if (ret < 0) {
+            return -1;
+        }
+        line = nl + 1;
+    }
+    cl->len -= line - cl->buf;
+    memmove(cl->buf, line, cl->len);
+    if (cl->len == sizeof(cl->buf) - 1) {
+        // line too long
+        return -1;
+    }
+    return flush_client(cl);
+}
+
+int control_pollfds(struct control *c, struct pollfd *fds) {
+    int i;
+    fds[0].fd = c->listen_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    for (i = 0; i < c->nclients; i++) {
+        fds[i + 1].fd = c->clients[i].fd;
+        fds[i + 1].events = c->clients[i].out_len > 0 ? POLLOUT : POLLIN;
+        fds[i + 1].revents = 0;
+    }
+    return c->nclients + 1;
+}
+
+void control_handle(struct control *c, struct limiter *l,
+                    struct pollfd *fds, int nfds) {
+    int i;
+    // serve clients from the back, drop_client() moves the last one
+    for (i = nfds - 1; i >= 1; i--) {
+        if (fds[i].revents &&
+            serve_client(c, l, i - 1, fds[i].revents) < 0) {
+            drop_client(c, i - 1);
+        }
+    }
+    if (fds[0].revents & POLLIN) {
+        int fd;
+        while ((fd = accept4(c->listen_fd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            if (c->nclients == CONTROL_MAX_CLIENTS) {
+                close(fd);
+                continue;
+            }
+            memset(&c->clients[c->nclients], 0, sizeof(c->clients[0]));
+            c->clients[c->nclients].fd = fd;
+            c->nclients++;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+/**
+ * @file control.h
+ * @brief unix socket to query and change a running limiter.
+ */
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <poll.h>
+
+#include "limiter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CONTROL_MAX_CLIENTS 16
+#define CONTROL_MAX_LINE 256
+
+struct control_client {
+    int fd;
+    int len;
+    char buf[CONTROL_MAX_LINE];
+    // replies the socket did not take yet, sent on POLLOUT. no command is
+    // read while some are pending, so a client that does not read its
+    // replies holds at most one read of commands worth of them
+    char *out;
+    size_t out_len, out_cap;
+};
+
+// line based text protocol, one command per line:
+//   status                          one line per target
+//   threads <pid|all>               usage of each thread, hottest first
+//   metrics                         prometheus text, see metrics.h
+//   set <pid|all> percent <N>       change limit, N may be fractional
+//   set <pid|all> cores <N>         same as percent N * 100
+//   set interval <ms>               change sampling interval
+//   pause <pid|all>                 stop enforcing, target runs freely
+//   resume <pid|all>                enforce again
+// every reply ends with a line "ok" or "error <reason>".
+// changes are applied from the next tick, history windows are kept.
+struct control {
+    int listen_fd;
+    char path[CONTROL_MAX_LINE];
+    struct control_client clients[CONTROL_MAX_CLIENTS];
+    int nclients;
+};
+
+int control_open(struct control *c, const char *path);
+void control_close(struct control *c);
+
+// fill fds with the listening socket and clients, return number filled,
+// at most CONTROL_MAX_CLIENTS + 1.
+int control_pollfds(struct control *c, struct pollfd *fds);
+// accept clients and serve commands after poll() on control_pollfds().
+void control_handle(struct control *c, struct limiter *l,
+                    struct pollfd *fds, int nfds);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONTROL_H_ */
@@ -0,0 +1,135 @@
+/**
+ * @file controller.c
+ * @brief threshold, pid and pwm control laws.
+ */
+
+#include "controller.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DEMAND_EMA_ALPHA 0.2
+
+static double clamp(double v, double lo, double hi) {
+    return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// fraction of time the target may run to get limit, given its demand.
+static double feedforward_duty(struct controller *c, double limit) {
+    if (c->demand <= limit) {
+        return 1.0;
+    }
+    return limit / c->demand;
+}
+
+static int threshold_decide(struct controller *c, const struct ctl_input *in) {
+    (void)c;
+    return in->usage >= in->limit;
+}
+
+// the integral term works on per tick usage, so the long run average
+// converges to limit even when the window average is biased.
+static int pid_decide(struct controller *c, const struct ctl_input *in) {
+    double error = in->limit - in->usage;
+    double tick_error = in->limit - in->tick_usage;
+    double derivative = in->dt > 0 ? (error - c->prev_error) / in->dt : 0;
+    c->prev_error = error;
+
+    if (c->conf.ki > 0) {
+        // anti windup, integral term alone never exceeds a full duty cycle
+        double bound = 1.0 / c->conf.ki;
+        c->integral = clamp(c->integral + tick_error * in->dt, -bound, bound);
+    }
+
+    double duty = feedforward_duty(c, in->limit) + c->conf.kp * error +
+                  c->conf.ki * c->integral + c->conf.kd * derivative;
+    duty = clamp(duty, 0, 1);
+
+    // sigma-delta, run duty of all ticks spread as evenly as possible
+    c->acc += duty;
+    if (c->acc >= 1.0) {
+        c->acc -= 1.0;
+        return 0;
+    }
+    return 1;
+}
+
+// run on_ticks then stop until the end of period, two signals per period.
+static int pwm_decide(struct controller *c, const struct ctl_input *in) {
+    if (c->phase == 0) {
+        double duty = feedforward_duty(c, in->limit);
+        c->on_ticks = (int)(duty * c->conf.period + 0.5);
+    }
+    int stop = c->phase >= c->on_ticks;
+    c->phase = (c->phase + 1) % c->conf.period;
+    return stop;
+}
+
+const struct controller_ops controller_threshold = {"threshold",
+                                                    threshold_decide};
+const struct controller_ops controller_pid = {"pid", pid_decide};
+const struct controller_ops controller_pwm = {"pwm", pwm_decide};
+
+static const struct controller_ops *all_controllers[] = {
+    &controller_threshold, &controller_pid, &controller_pwm, NULL};
+
+int controller_parse(struct controller_conf *conf, const char *spec) {
+    const struct controller_ops **it;
+    double args[3];
+    int nargs = 0;
+    size_t namelen = strcspn(spec, ":");
+
+    memset(conf, 0, sizeof(*conf));
+    for (it = all_controllers; *it; it++) {
+        if (strlen((*it)->name) == namelen &&
+            strncmp((*it)->name, spec, namelen) == 0) {
+            conf->ops = *it;
+        }
+    }
+    if (conf->ops == NULL) {
+        fprintf(stderr, "unknown controller %s\n", spec);
+        return -1;
+    }
+
+    if (spec[namelen] == ':') {
+        const char *p = spec + namelen + 1;
+        while (*p && nargs < 3) {
+            char *end;
+            args[nargs++] = strtod(p, &end);
+            if (end == p || (*end && *end != ',')) {
+                fprintf(stderr, "invalid controller args %s\n", spec);
+                return -1;
+            }
+            p = *end ? end + 1 : end;
+        }
+    }
+
+    conf->kp = nargs > 0 ? args[0] : 0.005;
+    conf->ki = nargs > 1 ? args[1] : 0.02;
+    conf->kd = nargs > 2 ? args[2] : 0;
+    conf->period = 10;
+    if (conf->ops == &controller_pwm && nargs > 0) {
+        conf->period = (int)args[0];
+    }
+    if (conf->period <= 0) {
+        fprintf(stderr, "invalid pwm period %s\n", spec);
+        return -1;
+    }
+    return 0;
+}
+
+void controller_init(struct controller *c, const struct controller_conf *conf) {
+    memset(c, 0, sizeof(*c));
+    c->conf = *conf;
+}
+
+int controller_decide(struct controller *c, const struct ctl_input *in) {
+    if (!in->was_stopped) {
+        c->demand = c->demand == 0
+                        ? in->tick_usage
+                        : c->demand * (1 - DEMAND_EMA_ALPHA) +
+                              in->tick_usage * DEMAND_EMA_ALPHA;
+    }
+    return c->conf.ops->decide(c, in);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file controller.h
+ * @brief control laws deciding when a target is stopped or continued.
+ */
+
+#ifndef CONTROLLER_H_
+#define CONTROLLER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// what a controller sees each tick, usages are in percent of one cpu.
+struct ctl_input {
+    double limit;
+    // average usage over the history window
+    double usage;
+    // usage since the previous tick
+    double tick_usage;
+    // target was stopped during the previous tick
+    int was_stopped;
+    // seconds since the previous tick
+    double dt;
+};
+
+struct controller;
+
+struct controller_ops {
+    const char *name;
+    // return 1 if the target should be stopped until next tick, 0 to run it.
+    int (*decide)(struct controller *c, const struct ctl_input *in);
+};
+
+// parameters given by --controller, see controller_parse().
+struct controller_conf {
+    const struct controller_ops *ops;
+    double kp, ki, kd;
+    int period;
+};
+
+struct controller {
+    struct controller_conf conf;
+
+    // usage of the target when it is not stopped, estimated by ema
+    double demand;
+    // pid state
+    double integral, prev_error;
+    // sigma-delta accumulator turning a duty cycle into stop/run ticks
+    double acc;
+    // pwm state, ticks into current period and ticks to run in it
+    int phase, on_ticks;
+};
+
+// "threshold": stop when window usage >= limit, continue below it.
+extern const struct controller_ops controller_threshold;
+// "pid[:kp,ki,kd]": pid on usage error around a feedforward duty cycle.
+extern const struct controller_ops controller_pid;
+// "pwm[:period]": run a computed number of ticks out of every period.
+extern const struct controller_ops controller_pwm;
+
+// parse "name[:arg,arg...]", return 0 on success.
+int controller_parse(struct controller_conf *conf, const char *spec);
+void controller_init(struct controller *c, const struct controller_conf *conf);
+int controller_decide(struct controller *c, const struct ctl_input *in);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CONTROLLER_H_ */
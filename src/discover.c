@@ -0,0 +1,220 @@
+/**
+ * @file discover.c
+ * @brief netlink proc connector listener with a delta /proc scan fallback.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "discover.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "limiter.h"
+#include "policy.h"
+#include "sample.h"
+
+#define NL_BUF_LEN 8192
+
+// subscribe to or unsubscribe from proc events.
+static int nl_listen(int fd, int on) {
+    struct {
+        struct nlmsghdr nl;
+        struct cn_msg cn;
+        enum proc_cn_mcast_op op;
+    } __attribute__((packed)) msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.nl.nlmsg_len = sizeof(msg);
+    msg.nl.nlmsg_type = NLMSG_DONE;
+    msg.nl.nlmsg_pid = getpid();
+    msg.cn.id.idx = CN_IDX_PROC;
+    msg.cn.id.val = CN_VAL_PROC;
+    msg.cn.len = sizeof(msg.op);
+    msg.op = on ? PROC_CN_MCAST_LISTEN : PROC_CN_MCAST_IGNORE;
+    return send(fd, &msg, sizeof(msg), 0) < 0 ? -1 : 0;
+}
+
+static int nl_open() {
+    struct sockaddr_nl addr;
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    NETLINK_CONNECTOR);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    addr.nl_pid = getpid();
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        nl_listen(fd, 1) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int push_pid(int **list, int *n, int *cap, int pid) {
+    if (*n == *cap) {
+        int new_cap = *cap ? *cap * 2 : 256;
+        int *p = realloc(*list, new_cap * sizeof(int));
+        if (p == NULL) {
+            return -1;
+        }
+        *list = p;
+        *cap = new_cap;
+    }
+    (*list)[(*n)++] = pid;
+    return 0;
+}
+
+// list /proc, match pids the previous scan did not see and the fresh ones
+// of the previous scan. l is NULL to only learn what is running.
+static int delta_scan(struct discover *d, struct limiter *l) {
+    DIR *dir = opendir("/proc");
+    struct dirent *ent;
+    int nscan = 0, i;
+
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        if (push_pid(&d->scan, &nscan, &d->scan_cap, atoi(ent->d_name)) < 0) {
+            break;
+        }
+    }
+    closedir(dir);
+    qsort(d->scan, nscan, sizeof(int), cmp_int);
+
+    if (l != NULL) {
+        for (i = 0; i < d->nfresh; i++) {
+            policy_check_pid(d->policy, l, d->fresh[i]);
+        }
+    }
+    d->nfresh = 0;
+    for (i = 0; i < nscan && l != NULL; i++) {
+        int pid = d->scan[i];
+        if (bsearch(&pid, d->known, d->nknown, sizeof(int), cmp_int) == NULL) {
+            policy_check_pid(d->policy, l, pid);
+            push_pid(&d->fresh, &d->nfresh, &d->fresh_cap, pid);
+        }
+    }
+
+    int *tmp = d->known;
+    int tmp_cap = d->known_cap;
+    d->known = d->scan;
+    d->known_cap = d->scan_cap;
+    d->nknown = nscan;
+    d->scan = tmp;
+    d->scan_cap = tmp_cap;
+    return 0;
+}
+
+int discover_open(struct discover *d, struct policy *p, long interval_ms) {
+    memset(d, 0, sizeof(*d));
+    d->policy = p;
+    d->interval_ms = interval_ms;
+    d->nl_fd = nl_open();
+    if (d->nl_fd < 0) {
+        fprintf(stdout,
+                "proc connector unavailable (%s), scanning /proc every %ldms\n",
+                strerror(errno), interval_ms);
+        delta_scan(d, NULL);
+    }
+    read_clock_ns(CLOCK_MONOTONIC, &d->last_scan_ns);
+    return 0;
+}
+
+void discover_close(struct discover *d) {
+    if (d->nl_fd >= 0) {
+        nl_listen(d->nl_fd, 0);
+        close(d->nl_fd);
+    }
+    free(d->known);
+    free(d->fresh);
+    free(d->scan);
+    memset(d, 0, sizeof(*d));
+    d->nl_fd = -1;
+}
+
+int discover_fd(struct discover *d) { return d->nl_fd; }
+
+void discover_handle(struct discover *d, struct limiter *l) {
+    char buf[NL_BUF_LEN] __attribute__((aligned(NLMSG_ALIGNTO)));
+    ssize_t n;
+
+    while ((n = recv(d->nl_fd, buf, sizeof(buf), 0)) != 0) {
+        if (n < 0) {
+            if (errno == ENOBUFS) {
+                // events were dropped, look at everything once
+                policy_apply(d->policy, l);
+                continue;
+            }
+            return;
+        }
+        struct nlmsghdr *nl = (struct nlmsghdr *)buf;
+        for (; NLMSG_OK(nl, n); nl = NLMSG_NEXT(nl, n)) {
+            if (nl->nlmsg_type == NLMSG_NOOP || nl->nlmsg_type == NLMSG_ERROR) {
+                continue;
+            }
+            struct cn_msg *cn = NLMSG_DATA(nl);
+            if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC) {
+                continue;
+            }
+            struct proc_event *ev = (struct proc_event *)cn->data;
+            switch (ev->what) {
+                case PROC_EVENT_FORK:
+                    // new threads are no new processes
+                    if (ev->event_data.fork.child_pid ==
+                        ev->event_data.fork.child_tgid) {
+                        policy_check_pid(d->policy, l,
+                                         ev->event_data.fork.child_tgid);
+                    }
+                    break;
+                case PROC_EVENT_EXEC:
+                    policy_check_pid(d->policy, l,
+                                     ev->event_data.exec.process_tgid);
+                    break;
+                case PROC_EVENT_COMM:
+                    policy_check_pid(d->policy, l,
+                                     ev->event_data.comm.process_tgid);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+}
+
+void discover_tick(struct discover *d, struct limiter *l) {
+    int i;
+
+    if (d->nl_fd < 0 && l->last_tick_ns - d->last_scan_ns >=
+                            d->interval_ms * 1000000LL) {
+        delta_scan(d, l);
+        d->last_scan_ns = l->last_tick_ns;
+    }
+    // exited processes are never coming back, keep the table small
+    for (i = l->ntargets - 1; i >= 0; i--) {
+        if (l->targets[i].policy && l->targets[i].exited) {
+            limiter_remove(l, i);
+        }
+    }
+}
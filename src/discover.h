@@ -0,0 +1,51 @@
+/**
+ * @file discover.h
+ * @brief find new processes matching policy rules as they start.
+ */
+
+#ifndef DISCOVER_H_
+#define DISCOVER_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct limiter;
+struct policy;
+
+// new processes are reported by the netlink proc connector when we are
+// allowed to listen to it (CAP_NET_ADMIN), else /proc is re-scanned every
+// interval_ms and only pids not seen by the previous scan are matched.
+struct discover {
+    struct policy *policy;
+    // netlink proc connector socket, -1 when scanning
+    int nl_fd;
+    // sorted pids of the last scan
+    int *known;
+    int nknown, known_cap;
+    // pids new in the last scan, matched once more in case they called
+    // exec() after we looked at them
+    int *fresh;
+    int nfresh, fresh_cap;
+    // scratch for the running scan
+    int *scan;
+    int scan_cap;
+    long interval_ms;
+    long long last_scan_ns;
+};
+
+// start watching for new processes, rules come from p.
+int discover_open(struct discover *d, struct policy *p, long interval_ms);
+void discover_close(struct discover *d);
+// fd to poll for events, -1 when scanning.
+int discover_fd(struct discover *d);
+// read pending connector events and attach matching processes.
+void discover_handle(struct discover *d, struct limiter *l);
+// called every tick, scans /proc when due and drops exited targets.
+void discover_tick(struct discover *d, struct limiter *l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DISCOVER_H_ */
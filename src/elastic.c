@@ -0,0 +1,108 @@
+/**
+ * @file elastic.c
+ * @brief measure cpu contention and stretch limits while there is none.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "elastic.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+// "some avg10=0.12 avg60=0.05 avg300=0.01 total=123456", us of stall
+static int read_stall(struct elastic *e, long long *stall) {
+    if (proc_file_read(&e->file) < 0) {
+        return -1;
+    }
+    const char *p = strstr(e->file.buf, "total=");
+    if (strncmp(e->file.buf, "some ", 5) != 0 || p == NULL ||
+        sscanf(p + 6, "%lld", stall) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// idle + iowait and all jiffies of the "cpu" line of /proc/stat.
+static int read_idle(struct elastic *e, long long *idle, long long *total) {
+    long long v[8] = {0};
+    if (proc_file_read(&e->file) < 0 ||
+        sscanf(e->file.buf, "cpu %lld %lld %lld %lld %lld %lld %lld %lld",
+               &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]) < 4 ||
+        parse_total_cpu(e->file.buf, total) < 0) {
+        return -1;
+    }
+    *idle = v[3] + v[4];
+    return 0;
+}
+
+int elastic_open(struct elastic *e, double ceiling, double pressure,
+                 long response_ms) {
+    memset(e, 0, sizeof(*e));
+    e->ceiling = ceiling;
+    e->pressure = pressure;
+    e->response_ns = response_ms * 1000000LL;
+    if (proc_file_open(&e->file, "/proc/pressure/cpu") == 0 &&
+        read_stall(e, &e->prev_stall) == 0) {
+        e->psi = 1;
+        return 0;
+    }
+    proc_file_close(&e->file);
+    fprintf(stderr, "/proc/pressure/cpu unavailable, using idle time of "
+                    "/proc/stat\n");
+    if (proc_file_open(&e->file, "/proc/stat") < 0 ||
+        read_idle(e, &e->prev_idle, &e->prev_total) < 0) {
+        fprintf(stderr, "open(/proc/stat) failed: %s\n", strerror(errno));
+        proc_file_close(&e->file);
+        return -1;
+    }
+    return 0;
+}
+
+void elastic_close(struct elastic *e) { proc_file_close(&e->file); }
+
+void elastic_update(struct elastic *e, long long now_ns) {
+    double raw;
+    if (e->prev_ns == 0 || now_ns <= e->prev_ns) {
+        e->prev_ns = now_ns;
+        return;
+    }
+    double dt = now_ns - e->prev_ns;
+    if (e->psi) {
+        long long stall;
+        if (read_stall(e, &stall) < 0) {
+            return;
+        }
+        // share of wall time some task was runnable but not running
+        raw = (stall - e->prev_stall) * 1000.0 / dt / e->pressure;
+        e->prev_stall = stall;
+    } else {
+        long long idle, total;
+        if (read_idle(e, &idle, &total) < 0) {
+            return;
+        }
+        if (total <= e->prev_total) {
+            return;
+        }
+        // no idle time left is the closest /proc/stat has to waiting work
+        double idle_share = (double)(idle - e->prev_idle) /
+                            (total - e->prev_total);
+        raw = 1 - idle_share / e->pressure;
+        e->prev_idle = idle;
+        e->prev_total = total;
+    }
+    raw = raw < 0 ? 0 : (raw > 1 ? 1 : raw);
+    // first order low pass with time constant response_ns
+    double alpha = dt / (e->response_ns + dt);
+    e->contention += (raw - e->contention) * alpha;
+    e->prev_ns = now_ns;
+}
+
+double elastic_limit(const struct elastic *e, double floor, double capacity) {
+    double ceiling = e->ceiling > 0 ? e->ceiling : capacity;
+    if (ceiling <= floor) {
+        return floor;
+    }
+    return floor + (ceiling - floor) * (1 - e->contention);
+}
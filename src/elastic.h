@@ -0,0 +1,52 @@
+/**
+ * @file elastic.h
+ * @brief elastic limits: targets may use idle cpus, and are held to their
+ * limit only while other work waits for a cpu.
+ */
+
+#ifndef ELASTIC_H_
+#define ELASTIC_H_
+
+#include "sample.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// contention of the machine from /proc/pressure/cpu, or from the idle share
+// of /proc/stat on kernels without psi.
+struct elastic {
+    // limit while nothing else waits in percent, 0 for the capacity of
+    // each target
+    double ceiling;
+    // share of time some task waits for a cpu at which limits are back at
+    // their floor. without psi, the share of idle time below which they are
+    double pressure;
+    // time constant of the smoothing of contention
+    long long response_ns;
+
+    int psi;
+    struct proc_file file;
+    // last stall total in us, or idle and total jiffies of /proc/stat
+    long long prev_stall, prev_idle, prev_total;
+    long long prev_ns;
+    // 0 when the machine is free, 1 when limits are at their floor
+    double contention;
+};
+
+// open the pressure source, return 0 on success.
+int elastic_open(struct elastic *e, double ceiling, double pressure,
+                 long response_ms);
+void elastic_close(struct elastic *e);
+
+// sample contention once per tick.
+void elastic_update(struct elastic *e, long long now_ns);
+
+// limit of a target with limit floor that could use capacity percent.
+double elastic_limit(const struct elastic *e, double floor, double capacity);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ELASTIC_H_ */
@@ -0,0 +1,130 @@
+/**
+ * @file horizon.c
+ * @brief parse --horizons and keep bucketed sliding sums per window.
+ */
+
+#include "horizon.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// "10ms", "1.5s", "10m" or "2h" to ns, -1 if invalid.
+static long long parse_window(const char *p, int len) {
+    char *end;
+    double v = strtod(p, &end);
+    int unit_len = len - (end - p);
+    double scale;
+    if (end == p || v <= 0) {
+        return -1;
+    }
+    if (unit_len == 2 && strncmp(end, "ms", 2) == 0) {
+        scale = 1e6;
+    } else if (unit_len == 1 && *end == 's') {
+        scale = 1e9;
+    } else if (unit_len == 1 && *end == 'm') {
+        scale = 60e9;
+    } else if (unit_len == 1 && *end == 'h') {
+        scale = 3600e9;
+    } else {
+        return -1;
+    }
+    return v * scale;
+}
+
+int horizon_parse(struct horizon_conf *confs, const char *spec) {
+    const char *p = spec;
+    int n = 0;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        int len = end ? end - p : (int)strlen(p);
+        const char *at = memchr(p, '@', len);
+        char *num_end;
+        if (n == MAX_HORIZONS) {
+            fprintf(stderr, "at most %d horizons: %s\n", MAX_HORIZONS, spec);
+            return -1;
+        }
+        if (at == NULL) {
+            fprintf(stderr, "invalid horizon %.*s\n", len, p);
+            return -1;
+        }
+        confs[n].limit = strtod(p, &num_end);
+        confs[n].window_ns = parse_window(at + 1, len - (at + 1 - p));
+        if (num_end != at || confs[n].limit <= 0 || confs[n].window_ns <= 0) {
+            fprintf(stderr, "invalid horizon %.*s\n", len, p);
+            return -1;
+        }
+        n++;
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return n;
+}
+
+void horizon_init(struct horizon *h, const struct horizon_conf *conf) {
+    memset(h, 0, sizeof(*h));
+    h->conf = *conf;
+    h->bucket_ns = conf->window_ns / HORIZON_BUCKETS;
+    if (h->bucket_ns <= 0) {
+        h->bucket_ns = 1;
+    }
+}
+
+// move the current bucket into the ring, the oldest one drops out.
+static void push_bucket(struct horizon *h) {
+    h->sum_proc += h->cur_proc - h->proc[h->idx];
+    h->sum_total += h->cur_total - h->total[h->idx];
+    h->proc[h->idx] = h->cur_proc;
+    h->total[h->idx] = h->cur_total;
+    h->idx = (h->idx + 1) % HORIZON_BUCKETS;
+    h->cur_proc = h->cur_total = 0;
+    h->cur_start_ns += h->bucket_ns;
+}
+
+void horizon_sample(struct horizon *h, long long now_ns, long long proc_time,
+                    long long total) {
+    long long proc_since = proc_time - h->last_proc;
+    long long total_since = total - h->last_total;
+    int i;
+    h->last_proc = proc_time;
+    h->last_total = total;
+    if (proc_since < 0) {
+        // a tree member that exited took its time along
+        proc_since = 0;
+    }
+    if (!h->started) {
+        h->started = 1;
+        h->cur_start_ns = h->first_ns = h->last_ns = now_ns;
+        return;
+    }
+    h->last_ns = now_ns;
+    // the time of a tick goes to the bucket it ends in. after a gap longer
+    // than the window every bucket is pushed out, never more
+    for (i = 0;
+         i < HORIZON_BUCKETS && now_ns - h->cur_start_ns >= h->bucket_ns;
+         i++) {
+        push_bucket(h);
+    }
+    if (now_ns - h->cur_start_ns >= h->bucket_ns) {
+        h->cur_start_ns = now_ns;
+    }
+    h->cur_proc += proc_since;
+    h->cur_total += total_since;
+}
+
+double horizon_share(const struct horizon *h) {
+    long long total = h->sum_total + h->cur_total;
+    long long covered = h->last_ns - h->first_ns;
+    double share;
+    if (total <= 0) {
+        return 0;
+    }
+    share = (double)(h->sum_proc + h->cur_proc) / total;
+    if (covered < h->conf.window_ns) {
+        // the sums hold only covered ns of the window
+        share = share * covered / h->conf.window_ns;
+    }
+    return share;
+}
@@ -0,0 +1,66 @@
+/**
+ * @file horizon.h
+ * @brief extra limits of a target averaged over long windows, with constant
+ * time sliding sums.
+ */
+
+#ifndef HORIZON_H_
+#define HORIZON_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_HORIZONS 4
+// a window is kept as this many complete buckets and the one being filled:
+// memory is fixed whatever its length, and once the target is older than
+// the window the sums cover between window and window + window /
+// HORIZON_BUCKETS of the past
+#define HORIZON_BUCKETS 64
+
+// one "percent@window" of --horizons.
+struct horizon_conf {
+    double limit;
+    long long window_ns;
+};
+
+// sliding sums of cpu time and total time over one window.
+struct horizon {
+    struct horizon_conf conf;
+    long long bucket_ns;
+    // time of each complete bucket in accounting units, and their sums
+    long long proc[HORIZON_BUCKETS], total[HORIZON_BUCKETS];
+    long long sum_proc, sum_total;
+    int idx;
+    // bucket being filled since cur_start_ns
+    long long cur_proc, cur_total, cur_start_ns;
+    // last sample, deltas are taken against it
+    long long last_proc, last_total;
+    int started;
+    // time of the first and the last sample
+    long long first_ns, last_ns;
+    // over its limit at the last tick, and how often it went over
+    int over;
+    long nstop;
+};
+
+// parse "percent@window[,percent@window...]", window in ms, s, m or h,
+// e.g. "400@1s,150@10m". "" is no horizon. return number of horizons, or
+// -1 on error.
+int horizon_parse(struct horizon_conf *confs, const char *spec);
+
+void horizon_init(struct horizon *h, const struct horizon_conf *conf);
+// add the sample of a tick at now_ns: cpu time of the target and all time
+// that passed, in accounting units. buckets that ended are pushed out.
+void horizon_sample(struct horizon *h, long long now_ns, long long proc_time,
+                    long long total);
+// share of total time the target used over the window, 0 to 1 of all cpus.
+// a target younger than the window counts as idle before it started, so a
+// burst at start-up is measured against the whole window.
+double horizon_share(const struct horizon *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HORIZON_H_ */
@@ -0,0 +1,854 @@
+/**
+ * @file limiter.c
+ * @brief sampling loop shared by all limited targets.
+ */
+
+#define _GNU_SOURCE
+
+#include "limiter.h"
+
+#include "budget.h"
+#include "control.h"
+#include "discover.h"
+#include "elastic.h"
+#include "metrics.h"
+#include "policy.h"
+#include "status.h"
+#include "trace.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/sysinfo.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 256
+
+static volatile sig_atomic_t quit_requested = 0;
+
+int limiter_init(struct limiter *l, long interval_ms,
+                 const struct controller_conf *controller) {
+    memset(l, 0, sizeof(*l));
+    l->interval_ms = interval_ms;
+    l->controller = *controller;
+    l->nproc = get_nprocs();
+    l->capacity = cpu_capacity(0);
+    l->io = &limiter_io_proc;
+    if (proc_file_open(&l->proc_stat, "/proc/stat") < 0) {
+        fprintf(stderr, "open(/proc/stat) failed: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+int limiter_set_accounting(struct limiter *l, const char *name) {
+    clockid_t clock;
+    if (strcmp(name, "auto") == 0) {
+        l->accounting = pid_cpuclock(getpid(), &clock) == 0
+                            ? ACCOUNTING_CPUCLOCK
+                            : ACCOUNTING_JIFFIES;
+    } else if (strcmp(name, "cpuclock") == 0) {
+        l->accounting = ACCOUNTING_CPUCLOCK;
+    } else if (strcmp(name, "jiffies") == 0) {
+        l->accounting = ACCOUNTING_JIFFIES;
+    } else {
+        fprintf(stderr, "unknown accounting %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+void limiter_free(struct limiter *l) {
+    int i;
+    for (i = 0; i < l->ntargets; i++) {
+        l->io->detach(l, &l->targets[i]);
+    }
+    proc_file_close(&l->proc_stat);
+    free(l->targets);
+    memset(l, 0, sizeof(*l));
+}
+
+struct target *limiter_add(struct limiter *l, int pid, double percent,
+                           int tree) {
+    if (pid <= 0 || percent <= 0) {
+        fprintf(stderr, "invalid target pid=%d percent=%g\n", pid, percent);
+        return NULL;
+    }
+    if (l->ntargets == l->targets_cap) {
+        int cap = l->targets_cap ? l->targets_cap * 2 : 8;
+        struct target *t = realloc(l->targets, cap * sizeof(struct target));
+        if (t == NULL) {
+            fprintf(stderr, "realloc targets failed\n");
+            return NULL;
+        }
+        l->targets = t;
+        l->targets_cap = cap;
+    }
+    struct target *t = &l->targets[l->ntargets];
+    memset(t, 0, sizeof(*t));
+    t->pid = pid;
+    t->percent = percent;
+    t->limit = percent;
+    t->tree = tree;
+    t->group = -1;
+    t->weight = 1;
+    t->status_slot = -1;
+    t->burst = l->burst;
+    t->tokens = l->burst;
+    t->io_read_limit = l->io_read_limit;
+    t->io_write_limit = l->io_write_limit;
+    for (t->nhorizons = 0; t->nhorizons < l->nhorizons; t->nhorizons++) {
+        horizon_init(&t->horizons[t->nhorizons], &l->horizons[t->nhorizons]);
+    }
+    if (l->io->attach(l, t) < 0) {
+        return NULL;
+    }
+    if (l->status) {
+        status_attach(l->status, t);
+    }
+    l->ntargets++;
+    controller_init(&t->controller, &l->controller);
+    l->nalive++;
+    return t;
+}
+
+int limiter_add_list(struct limiter *l, const char *list, int tree) {
+    const char *p = list;
+    while (*p) {
+        int pid, n = 0;
+        double percent;
+        if (sscanf(p, "%d:%lf%n", &pid, &percent, &n) != 2) {
+            fprintf(stderr, "invalid target list at '%s'\n", p);
+            return -1;
+        }
+        if (limiter_add(l, pid, percent, tree) == NULL) {
+            return -1;
+        }
+        p += n;
+        while (*p == ',' || *p == ' ') p++;
+    }
+    return 0;
+}
+
+long long get_total_cpu_usage(struct limiter *l) { return l->io->total(l); }
+
+static void send_signal(struct limiter *l, struct target *t, int sig) {
+    l->io->signal(l, t, sig);
+}
+
+// apply soft step level to t, steps past the ladder keep its last step.
+static void soft_demote(struct limiter *l, struct target *t, int level) {
+    if (l->io->demote) {
+        l->io->demote(l, t, level < l->soft.nsteps ? level : l->soft.nsteps);
+    }
+}
+
+void limiter_remove(struct limiter *l, int idx) {
+    struct target *t = &l->targets[idx];
+    if (!t->exited) {
+        if (t->is_stop) {
+            send_signal(l, t, SIGCONT);
+        }
+        if (t->soft_level > 0) {
+            soft_demote(l, t, 0);
+        }
+        l->nalive--;
+    }
+    l->io->detach(l, t);
+    if (l->status) {
+        status_detach(l->status, t);
+    }
+    l->targets[idx] = l->targets[--l->ntargets];
+}
+
+// open what sampling t needs: /proc/<pid>/stat, and its cpu clock.
+static int proc_attach(struct limiter *l, struct target *t) {
+    char stat_file[MAX_PATH_LEN], io_file[MAX_PATH_LEN];
+    sprintf(stat_file, "/proc/%d/stat", t->pid);
+    if (proc_file_open(&t->stat_file, stat_file) < 0) {
+        fprintf(stderr, "open(%s) failed: %s\n", stat_file, strerror(errno));
+        return -1;
+    }
+    t->io_file.fd = -1;
+    if (!t->tree && (t->io_read_limit || t->io_write_limit)) {
+        // readable only by the owner of the process or root
+        sprintf(io_file, "/proc/%d/io", t->pid);
+        if (proc_file_open(&t->io_file, io_file) < 0 ||
+            proc_file_read(&t->io_file) < 0) {
+            fprintf(stderr, "read %s failed: %s\n", io_file, strerror(errno));
+            proc_file_close(&t->io_file);
+            proc_file_close(&t->stat_file);
+            return -1;
+        }
+    }
+    if (l->accounting == ACCOUNTING_CPUCLOCK &&
+        pid_cpuclock(t->pid, &t->clock) < 0) {
+        fprintf(stderr, "cpu clock of pid %d: %s\n", t->pid, strerror(errno));
+        proc_file_close(&t->io_file);
+        proc_file_close(&t->stat_file);
+        return -1;
+    }
+    t->capacity = cpu_capacity(t->pid) * 100;
+    errno = 0;
+    t->nice0 = getpriority(PRIO_PROCESS, t->pid);
+    if (errno != 0) {
+        t->nice0 = 0;
+    }
+    t->soft_off = l->soft.nsteps > 0 && !soft_reversible(&l->soft, t->nice0);
+    if (t->soft_off) {
+        // with --thread-match nothing else throttles the target
+        fprintf(stderr,
+                "pid %d: nice %d could not be given back after --soft, "
+                "it is %s\n",
+                t->pid, t->nice0,
+                l->thread_match ? "not limited" : "stopped instead");
+    }
+    proc_tree_init(&t->proc_tree, t->pid,
+                   l->accounting == ACCOUNTING_CPUCLOCK);
+    return 0;
+}
+
+static void proc_detach(struct limiter *l, struct target *t) {
+    (void)l;
+    proc_tree_free(&t->proc_tree);
+    thread_table_free(&t->threads);
+    soft_saved_free(&t->soft_saved);
+    proc_file_close(&t->stat_file);
+    proc_file_close(&t->io_file);
+}
+
+// read cpu time of target, return -1 if it exited.
+static int proc_sample(struct limiter *l, struct target *t,
+                       long long *proc_time) {
+    struct pid_stat st;
+
+    if (t->tree) {
+        // children reaped by members are already counted by their own
+        // utime/stime, so cutime/cstime is not used in tree mode.
+        if (proc_tree_update(&t->proc_tree) < 0) {
+            fprintf(stdout, "pid %d exited\n", t->pid);
+            return -1;
+        }
+        *proc_time = t->proc_tree.total;
+        return 0;
+    }
+
+    if (l->accounting == ACCOUNTING_CPUCLOCK) {
+        // run time of reaped children is not in the cpu clock
+        if (read_clock_ns(t->clock, proc_time) < 0) {
+            fprintf(stdout, "pid %d exited %s\n", t->pid, strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (proc_file_read(&t->stat_file) < 0 ||
+        parse_pid_stat(t->stat_file.buf, &st) < 0) {
+        fprintf(stdout, "pid %d exited %s\n", t->pid, strerror(errno));
+        return -1;
+    }
+    *proc_time = st.utime + st.stime + st.cutime + st.cstime;
+    t->utime = st.utime + st.cutime;
+    t->stime = st.stime + st.cstime;
+    return 0;
+}
+
+// storage bytes of the target, summed over members in tree mode. bytes of
+// members that exited are lost, the sum is kept from going backward.
+static int proc_sample_io(struct limiter *l, struct target *t,
+                          long long *read_bytes, long long *write_bytes) {
+    long long r, w;
+    int i;
+    (void)l;
+    if (!t->tree) {
+        if (proc_file_read(&t->io_file) < 0) {
+            return -1;
+        }
+        return parse_pid_io(t->io_file.buf, read_bytes, write_bytes);
+    }
+    long long read_sum = 0, write_sum = 0;
+    // members of last update are kept in prev
+    for (i = 0; i < t->proc_tree.nprev; i++) {
+        if (read_pid_io(t->proc_tree.prev[i].pid, &r, &w) == 0) {
+            read_sum += r;
+            write_sum += w;
+        }
+    }
+    if (read_sum > *read_bytes) {
+        *read_bytes = read_sum;
+    }
+    if (write_sum > *write_bytes) {
+        *write_bytes = write_sum;
+    }
+    return 0;
+}
+
+static long long proc_total(struct limiter *l) {
+    long long total;
+    if (l->accounting == ACCOUNTING_CPUCLOCK) {
+        read_clock_ns(CLOCK_MONOTONIC, &total);
+        return total * l->nproc;
+    }
+    if (proc_file_read(&l->proc_stat) < 0 ||
+        parse_total_cpu(l->proc_stat.buf, &total) < 0) {
+        fprintf(stderr, "read /proc/stat failed\n");
+        return -1;
+    }
+    return total;
+}
+
+// send sig to the limited process, or to all of its descendants in tree mode.
+static void proc_signal(struct limiter *l, struct target *t, int sig) {
+    (void)l;
+    if (t->tree) {
+        proc_tree_signal(&t->proc_tree, sig);
+    } else {
+        kill(t->pid, sig);
+    }
+}
+
+static double proc_capacity(struct limiter *l, struct target *t) {
+    (void)l;
+    return cpu_capacity(t->pid) * 100;
+}
+
+static void proc_demote(struct limiter *l, struct target *t, int level) {
+    const struct soft_step *step;
+    int i;
+    if (level == 0) {
+        int failed = soft_restore(&t->soft_saved);
+        if (failed > 0) {
+            fprintf(stderr, "pid %d: %d threads left demoted: %s\n", t->pid,
+                    failed, strerror(errno));
+        }
+        return;
+    }
+    step = &l->soft.steps[level - 1];
+    if (!t->tree) {
+        soft_apply_pid(&t->soft_saved, t->pid, step, t->nice0,
+                       l->thread_match);
+    }
+    // members of last update are kept in prev
+    for (i = 0; t->tree && i < t->proc_tree.nprev; i++) {
+        soft_apply_pid(&t->soft_saved, t->proc_tree.prev[i].pid, step,
+                       t->nice0, l->thread_match);
+    }
+    t->soft_saved.demoted = 1;
+}
+
+static void proc_sample_threads(struct limiter *l, struct target *t) {
+    int i;
+    thread_table_begin(&t->threads);
+    if (!t->tree) {
+        thread_table_scan(&t->threads, t->pid, l->thread_match);
+    }
+    // members of last update are kept in prev
+    for (i = 0; t->tree && i < t->proc_tree.nprev; i++) {
+        thread_table_scan(&t->threads, t->proc_tree.prev[i].pid,
+                          l->thread_match);
+    }
+    thread_table_end(&t->threads, l->last_tick_ns);
+}
+
+static long long proc_now(struct limiter *l) {
+    long long now;
+    (void)l;
+    read_clock_ns(CLOCK_MONOTONIC, &now);
+    return now;
+}
+
+const struct limiter_io limiter_io_proc = {
+    "proc",         proc_attach,    proc_detach,         proc_sample,
+    proc_total,     proc_signal,    proc_capacity,       proc_demote,
+    proc_sample_io, proc_sample_threads, proc_now};
+
+// cpu usage in percent of one cpu between two samples.
+static double usage_between(struct limiter *l, struct time_history *from,
+                            struct time_history *to) {
+    long long proc_time_since = to->proc_time - from->proc_time;
+    long long total_time_since = to->total_cpu_usage - from->total_cpu_usage;
+    if (total_time_since <= 0) {
+        return 0;
+    }
+    return (proc_time_since * (double)100.0) / total_time_since * l->nproc;
+}
+
+// append the state of t at ts_ns to the trace.
+static void trace_target_at(struct limiter *l, struct target *t,
+                            struct time_history *th, double limit, int event,
+                            long long ts_ns) {
+    struct trace_record r;
+    r.ts_ns = ts_ns;
+    r.proc_time = th->proc_time;
+    r.total = th->total_cpu_usage;
+    r.utime = t->utime;
+    r.stime = t->stime;
+    r.usage = t->usage;
+    r.limit = limit;
+    r.pid = t->pid;
+    r.event = event;
+    r.stopped = t->is_stop;
+    r.cause = t->is_stop ? t->stop_cause : 0;
+    trace_write(l->trace, &r);
+}
+
+// append the state of t after this tick to the trace.
+static void trace_target(struct limiter *l, struct target *t,
+                         struct time_history *th, double limit, int event) {
+    trace_target_at(l, t, th, limit, event, l->last_tick_ns);
+}
+
+// move t along the soft ladder one step at a time: down after usage was
+// over the limit for soft.hold_ns, back while it stays well under it.
+// return 1 when the ladder is exhausted and stops are needed.
+static int soft_tier(struct limiter *l, struct target *t, double usage,
+                     double limit) {
+    const struct soft_conf *c = &l->soft;
+    // stops would freeze the threads that do not match too
+    int max_level = l->thread_match ? c->nsteps : c->nsteps + 1;
+    int trend = 0;
+    if (usage >= limit) {
+        trend = 1;
+    } else if (usage < limit * c->release && !t->is_stop) {
+        trend = -1;
+    }
+    if (trend != t->soft_trend) {
+        t->soft_trend = trend;
+        t->soft_since_ns = l->last_tick_ns;
+    }
+    if (trend != 0 && l->last_tick_ns - t->soft_since_ns >= c->hold_ns) {
+        int level = t->soft_level + trend;
+        if (level >= 0 && level <= max_level) {
+            t->soft_level = level;
+            soft_demote(l, t, level);
+        }
+        t->soft_since_ns = l->last_tick_ns;
+    }
+    return t->soft_level > c->nsteps;
+}
+
+// spend the bytes of one tick from credit that grows by limit per second,
+// up to one window of it. return 1 while the credit is overdrawn: bursts
+// larger than the window are paid back by a stop as long as they took.
+static int io_credit(double *credit, long long limit, long long bytes,
+                     double dt, double window) {
+    *credit += limit * dt - bytes;
+    if (*credit > limit * window) {
+        *credit = limit * window;
+    }
+    return *credit < 0;
+}
+
+// STOP_IO_* bits of the io limits t is over after the tick from prev to th,
+// rates over the window since from are kept for reports.
+static int io_over(struct target *t, struct time_history *from,
+                   struct time_history *prev, struct time_history *th) {
+    double window = (th->ns - from->ns) / 1e9;
+    double dt = (th->ns - prev->ns) / 1e9;
+    int cause = 0;
+    if (window <= 0 || dt <= 0) {
+        return 0;
+    }
+    t->read_rate = (th->read_bytes - from->read_bytes) / window;
+    t->write_rate = (th->write_bytes - from->write_bytes) / window;
+    if (t->io_read_limit &&
+        io_credit(&t->read_credit, t->io_read_limit,
+                  th->read_bytes - prev->read_bytes, dt, window)) {
+        cause |= STOP_IO_READ;
+    }
+    if (t->io_write_limit &&
+        io_credit(&t->write_credit, t->io_write_limit,
+                  th->write_bytes - prev->write_bytes, dt, window)) {
+        cause |= STOP_IO_WRITE;
+    }
+    return cause;
+}
+
+// whether a horizon of t is over its limit, every one can stop t on its
+// own. the long window average is held at the limit tick by tick.
+static int horizons_over(struct limiter *l, struct target *t) {
+    int i, over = 0;
+    for (i = 0; i < t->nhorizons; i++) {
+        struct horizon *h = &t->horizons[i];
+        int h_over = horizon_share(h) * 100 * l->nproc >= h->conf.limit;
+        if (h_over && !h->over) {
+            h->nstop++;
+        }
+        h->over = h_over;
+        over |= h_over;
+    }
+    return over;
+}
+
+// calculate current cpu usage of target, let the controller decide whether
+// to send SIGSTOP or SIGCONT to satisfy the limit.
+static void tick_target(struct limiter *l, struct target *t,
+                        long long total_cpu_usage) {
+    struct time_history *th = &t->history[t->history_idx];
+    struct time_history *th_last =
+        &t->history[(t->history_idx + MAX_HISTORY_LEN - 1) % MAX_HISTORY_LEN];
+    int i;
+    if (l->io->sample(l, t, &th->proc_time) < 0) {
+        if (t->is_stop) {
+            send_signal(l, t, SIGCONT);
+        }
+        t->exited = 1;
+        l->nalive--;
+        if (l->trace) {
+            trace_target(l, t, th_last, t->percent, TRACE_EXIT);
+        }
+        return;
+    }
+    th->total_cpu_usage = total_cpu_usage;
+    th->ns = l->last_tick_ns;
+    if ((t->io_read_limit || t->io_write_limit) && l->io->sample_io) {
+        // a failed read keeps the last counters, a rate of 0
+        th->read_bytes = th_last->read_bytes;
+        th->write_bytes = th_last->write_bytes;
+        l->io->sample_io(l, t, &th->read_bytes, &th->write_bytes);
+    }
+    if (t->is_stop) {
+        t->stopped_seconds += l->tick_dt;
+    }
+    if (l->threads_interval_ns > 0 && l->io->sample_threads &&
+        l->last_tick_ns - t->threads_ns >= l->threads_interval_ns) {
+        l->io->sample_threads(l, t);
+        t->threads_ns = l->last_tick_ns;
+    }
+
+    for (i = 0; i < t->nhorizons; i++) {
+        horizon_sample(&t->horizons[i], l->last_tick_ns, th->proc_time,
+                       th->total_cpu_usage);
+    }
+
+    t->history_idx++;
+    if (t->history_idx >= MAX_HISTORY_LEN) {
+        t->history_idx = 0;
+        t->full = 1;
+        // affinity may change at any time, look again once per window
+        t->capacity = l->io->capacity(l, t);
+        if (t->soft_level > 0) {
+            // threads started since the last step are not demoted yet
+            soft_demote(l, t, t->soft_level);
+        }
+    }
+    if (!t->full) {
+        if (l->trace) {
+            trace_target(l, t, th, t->percent, TRACE_SAMPLE);
+        }
+        return;
+    }
+
+    struct time_history *th_prev = &t->history[t->history_idx];
+    double cpu_usage = usage_between(l, th_prev, th);
+    t->usage = cpu_usage;
+    if (t->paused) {
+        int event = TRACE_SAMPLE;
+        if (t->is_stop) {
+            send_signal(l, t, SIGCONT);
+            t->is_stop = 0;
+            t->ncont++;
+            event = TRACE_CONT;
+        }
+        if (t->soft_level > 0) {
+            // a paused target runs as it did before the limiter
+            soft_demote(l, t, 0);
+            t->soft_level = 0;
+        }
+        if (l->trace) {
+            trace_target(l, t, th, t->percent, event);
+        }
+        return;
+    }
+
+    struct ctl_input in;
+    in.limit = t->group >= 0 ? t->budget : t->percent;
+    if (l->elastic && t->group < 0) {
+        in.limit = elastic_limit(l->elastic, t->percent, t->capacity);
+    }
+    if (in.limit > t->capacity) {
+        // more than the target can use is no limit at all
+        in.limit = t->capacity;
+    }
+    t->limit = in.limit;
+    in.usage = cpu_usage;
+    in.tick_usage = usage_between(l, th_last, th);
+    in.was_stopped = t->is_stop;
+    in.dt = l->tick_dt;
+    int stop = controller_decide(&t->controller, &in);
+    if (t->burst > 0) {
+        // a token bucket replaces the window average: run while there is
+        // credit, so idle targets get short spikes through unthrottled and
+        // the long run average is still limit.
+        t->tokens += (in.limit - in.tick_usage) / 100 * in.dt;
+        if (t->tokens > t->burst) {
+            t->tokens = t->burst;
+        }
+        stop = t->tokens <= 0;
+    }
+    if (l->soft.nsteps > 0 && !t->soft_off &&
+        !soft_tier(l, t, cpu_usage, in.limit)) {
+        // the scheduler holds the target down, no signals
+        stop = 0;
+    }
+    if (l->thread_match && t->soft_off) {
+        // a stop would freeze the threads that do not match
+        stop = 0;
+    }
+    if (t->nhorizons > 0 && horizons_over(l, t)) {
+        stop = 1;
+    }
+    int cause = stop ? STOP_CPU : 0;
+    if (t->io_read_limit || t->io_write_limit) {
+        cause |= io_over(t, th_prev, th_last, th);
+        stop = cause != 0;
+    }
+    if (stop && t->is_stop && l->max_stop_ns &&
+        l->last_tick_ns - t->stop_ns >= l->max_stop_ns) {
+        // the stall is long enough, run until the next tick
+        stop = 0;
+    }
+    int event = TRACE_SAMPLE;
+    t->stop_cause = stop ? cause : 0;
+
+    if (stop && !t->is_stop) {
+        event = TRACE_STOP;
+        send_signal(l, t, SIGSTOP);
+        t->is_stop = 1;
+        t->stop_ns = l->last_tick_ns;
+        t->nstop++;
+        t->nstop_cpu += (cause & STOP_CPU) != 0;
+        t->nstop_io_read += (cause & STOP_IO_READ) != 0;
+        t->nstop_io_write += (cause & STOP_IO_WRITE) != 0;
+#ifdef DEBUG
+        printf("STP:1 %d %lf >= %lf\n", t->pid, cpu_usage, in.limit);
+#endif
+    }
+    if (!stop && t->is_stop) {
+        event = TRACE_CONT;
+        send_signal(l, t, SIGCONT);
+        t->is_stop = 0;
+        t->ncont++;
+#ifdef DEBUG
+        printf("STP:0 %d %lf < %lf\n", t->pid, cpu_usage, in.limit);
+#endif
+    }
+    if (l->trace) {
+        trace_target(l, t, th, in.limit, event);
+    }
+}
+
+int limiter_tick(struct limiter *l, long long total_cpu_usage) {
+    int i;
+    long long now;
+    // ticks are longer than interval_ms when the limiter is delayed, the
+    // controllers need the real length.
+    now = l->io->now(l);
+    l->tick_dt = l->last_tick_ns ? (now - l->last_tick_ns) / 1e9
+                                 : l->interval_ms / 1000.0;
+    if (l->last_tick_ns) {
+        // a tick is missed when the limiter wakes a whole interval late
+        long periods = (now - l->last_tick_ns) / (l->interval_ms * 1000000L);
+        if (periods > 1) {
+            l->missed_ticks += periods - 1;
+        }
+    }
+    l->last_tick_ns = now;
+    if (l->elastic) {
+        elastic_update(l->elastic, now);
+    }
+    if (l->budget && l->budget->ngroups > 0) {
+        // split group budgets by the usage of the previous tick
+        budget_update(l->budget, l);
+    }
+    for (i = 0; i < l->ntargets; i++) {
+        if (!l->targets[i].exited) {
+            tick_target(l, &l->targets[i], total_cpu_usage);
+            if (l->status) {
+                status_update(l->status, l, &l->targets[i]);
+            }
+        }
+    }
+
+    long long end;
+    end = l->io->now(l);
+    l->ticks++;
+    l->tick_ns_sum += end - now;
+    if (end - now > l->tick_ns_max) {
+        l->tick_ns_max = end - now;
+    }
+    return l->nalive;
+}
+
+// continue targets whose stop reached max_stop_ns, return when the next
+// running stop reaches it, or 0 if no target is stopped.
+static long long release_stalls(struct limiter *l, long long now) {
+    long long next = 0;
+    int i;
+    for (i = 0; i < l->ntargets; i++) {
+        struct target *t = &l->targets[i];
+        if (t->exited || !t->is_stop) {
+            continue;
+        }
+        long long end = t->stop_ns + l->max_stop_ns;
+        if (end <= now) {
+            send_signal(l, t, SIGCONT);
+            t->is_stop = 0;
+            t->ncont++;
+            if (l->trace) {
+                struct time_history *th =
+                    &t->history[(t->history_idx + MAX_HISTORY_LEN - 1) %
+                                MAX_HISTORY_LEN];
+                trace_target_at(l, t, th, t->limit, TRACE_CONT, now);
+            }
+            if (l->status) {
+                status_update(l->status, l, t);
+            }
+        } else if (next == 0 || end < next) {
+            next = end;
+        }
+    }
+    return next;
+}
+
+// deadline of the next tick, deadlines that already passed are skipped
+// (and counted as missed by the next tick) rather than run back to back.
+static long long next_deadline(struct limiter *l) {
+    long long period = l->interval_ms * 1000000LL, now;
+    if (l->next_tick_ns == 0) {
+        l->next_tick_ns = l->last_tick_ns;
+    }
+    l->next_tick_ns += period;
+    read_clock_ns(CLOCK_MONOTONIC, &now);
+    if (l->next_tick_ns <= now) {
+        l->next_tick_ns += ((now - l->next_tick_ns) / period + 1) * period;
+    }
+    return l->next_tick_ns;
+}
+
+static void ns_to_timespec(long long ns, struct timespec *ts) {
+    ts->tv_sec = ns / 1000000000LL;
+    ts->tv_nsec = ns % 1000000000LL;
+}
+
+// sleep until next tick, serving the control socket, policy reloads and
+// process events meanwhile, and ending stops at max_stop_ns.
+static void limiter_sleep(struct limiter *l) {
+    struct pollfd fds[CONTROL_MAX_CLIENTS + 3];
+    struct timespec ts;
+    long long deadline = next_deadline(l);
+    if (l->control == NULL && l->policy == NULL && l->discover == NULL &&
+        l->max_stop_ns == 0) {
+        // absolute, so the time sampling took is not added to the period
+        ns_to_timespec(deadline, &ts);
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+                   EINTR &&
+               !quit_requested) {
+        }
+        return;
+    }
+    for (;;) {
+        long long now, wake;
+        int nfds = 0, ncontrol = 0, policy_idx = -1, discover_idx = -1;
+        read_clock_ns(CLOCK_MONOTONIC, &now);
+        if (now >= deadline || quit_requested) {
+            return;
+        }
+        wake = deadline;
+        if (l->max_stop_ns) {
+            long long next = release_stalls(l, now);
+            if (next && next < wake) {
+                wake = next;
+            }
+        }
+        if (l->policy) {
+            policy_idx = nfds;
+            fds[nfds].fd = l->policy->inotify_fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        if (l->discover) {
+            discover_idx = nfds;
+            fds[nfds].fd = discover_fd(l->discover);
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        if (l->control) {
+            ncontrol = control_pollfds(l->control, fds + nfds);
+        }
+        ns_to_timespec(wake - now, &ts);
+        if (ppoll(fds, nfds + ncontrol, &ts, NULL) <= 0) {
+            continue;
+        }
+        if (policy_idx >= 0 && fds[policy_idx].revents) {
+            policy_handle(l->policy, l);
+        }
+        if (discover_idx >= 0 && fds[discover_idx].revents) {
+            discover_handle(l->discover, l);
+        }
+        if (l->control) {
+            control_handle(l->control, l, fds + nfds, ncontrol);
+        }
+    }
+}
+
+int limiter_run(struct limiter *l) {
+    while ((l->nalive > 0 || l->daemon) && !quit_requested) {
+        // the cpu clock of a zombie child stays readable, reap spawned
+        // targets so their exit is seen
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+        // /proc/stat is read once per tick and shared by all targets
+        long long total_cpu_usage = get_total_cpu_usage(l);
+        limiter_tick(l, total_cpu_usage);
+        if (l->discover) {
+            discover_tick(l->discover, l);
+        }
+        if (l->metrics_path && l->last_tick_ns - l->last_metrics_ns >=
+                                   l->metrics_interval_ms * 1000000L) {
+            metrics_write_file(l, l->metrics_path);
+            l->last_metrics_ns = l->last_tick_ns;
+        }
+        limiter_sleep(l);
+    }
+    limiter_release(l);
+    return 0;
+}
+
+void limiter_quit() { quit_requested = 1; }
+
+void limiter_release(struct limiter *l) {
+    int i;
+    for (i = 0; i < l->ntargets; i++) {
+        struct target *t = &l->targets[i];
+        if (!t->exited && t->is_stop) {
+            send_signal(l, t, SIGCONT);
+            t->is_stop = 0;
+            t->ncont++;
+        }
+        if (!t->exited && t->soft_level > 0) {
+            soft_demote(l, t, 0);
+            t->soft_level = 0;
+        }
+    }
+}
+
+void limiter_report(struct limiter *l, FILE *out) {
+    int i;
+    for (i = 0; i < l->ntargets; i++) {
+        struct target *t = &l->targets[i];
+        fprintf(out,
+                "report pid=%d percent=%g stops=%ld conts=%ld stops_cpu=%ld "
+                "stops_io_read=%ld stops_io_write=%ld\n",
+                t->pid, t->percent, t->nstop, t->ncont, t->nstop_cpu,
+                t->nstop_io_read, t->nstop_io_write);
+    }
+}
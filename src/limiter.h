@@ -0,0 +1,276 @@
+/**
+ * @file limiter.h
+ * @brief limit cpu usage of a table of targets with one sampling loop.
+ */
+
+#ifndef LIMITER_H_
+#define LIMITER_H_
+
+#include <stdio.h>
+
+#include "controller.h"
+#include "horizon.h"
+#include "proc_tree.h"
+#include "sample.h"
+#include "soft.h"
+#include "threads.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// we store time stats of process in a circular queue array, each element store
+// a struct time_history. units depend on accounting of the limiter, jiffies
+// or ns.
+struct time_history {
+    long long proc_time;
+    long long total_cpu_usage;
+    // monotonic ns of the sample and storage bytes of /proc/<pid>/io, only
+    // sampled with io limits
+    long long ns;
+    long long read_bytes, write_bytes;
+};
+#define MAX_HISTORY_LEN 30
+
+// what made the limiter stop a target, bits of target.stop_cause
+#define STOP_CPU 1
+#define STOP_IO_READ 2
+#define STOP_IO_WRITE 4
+
+// a limited process, or a process tree when tree is set.
+struct target {
+    int pid;
+    // limit in percent of one cpu, 250 is two and a half cpus
+    double percent;
+    // limit enforced by the last tick: percent, or the group budget, at
+    // most capacity
+    double limit;
+    int tree;
+    // token bucket of --burst: cpu seconds the target may still run above
+    // limit. it fills at limit and drains by usage, burst 0 disables it
+    double burst;
+    double tokens;
+    struct proc_tree proc_tree;
+    // /proc/<pid>/stat kept open for jiffies accounting
+    struct proc_file stat_file;
+    // cpu clock for cpuclock accounting
+    clockid_t clock;
+    // storage bytes per second the target may read and write, 0 for no
+    // limit. credits are bytes it may still move, see io_credit().
+    // io_file is /proc/<pid>/io
+    long long io_read_limit, io_write_limit;
+    double read_credit, write_credit;
+    struct proc_file io_file;
+    // rates over the history window
+    double read_rate, write_rate;
+
+    struct time_history history[MAX_HISTORY_LEN];
+    int history_idx;
+    int full;
+
+    struct controller controller;
+    int is_stop;
+    // when the current stop began
+    long long stop_ns;
+    int exited;
+    // sampled but not enforced, set from the control socket
+    int paused;
+    // added by the policy file, seen is used while applying it
+    int policy;
+    int seen;
+    // budget group index, -1 if the target is limited by percent alone.
+    // members share the group budget by weight, percent caps each of them
+    int group;
+    double weight;
+    double budget;
+    // percent the target could use at most, from its affinity and cgroup
+    double capacity;
+
+    // step of the soft ladder, 0 for none and nsteps + 1 when the soft
+    // steps did not hold usage down and stops are sent again. soft_trend
+    // is 1 while usage is over the limit, -1 while well under it, since
+    // soft_since_ns
+    int soft_level;
+    int soft_trend;
+    long long soft_since_ns;
+    // nice of the target when it was added, given to threads that were
+    // started while demoted when the soft level is restored
+    int nice0;
+    // how the demoted threads were scheduled before the first step
+    struct soft_saved soft_saved;
+    // the --soft steps could not be undone on the target, it is stopped
+    // like without them
+    int soft_off;
+
+    long nstop, ncont;
+    // STOP_* bits of the resources over their limit while stopped, and
+    // stops each of them took part in
+    int stop_cause;
+    long nstop_cpu, nstop_io_read, nstop_io_write;
+    // raw counters of the last jiffies sample of one process, for traces
+    long utime, stime;
+    // metrics, updated from values the tick already has
+    double usage;
+    double stopped_seconds;
+    // entry in the status page, -1 without one
+    int status_slot;
+    // usage of each thread, scanned every threads_interval_ns at
+    // threads_ns
+    struct thread_table threads;
+    long long threads_ns;
+    // limits over longer windows, each one stops the target on its own
+    struct horizon horizons[MAX_HORIZONS];
+    int nhorizons;
+};
+
+struct limiter;
+
+// where samples come from and where signals go: /proc and kill() for real
+// processes, a simulator replaces them to run controllers in virtual time.
+struct limiter_io {
+    const char *name;
+    // prepare sampling of a new target, return 0 on success
+    int (*attach)(struct limiter *l, struct target *t);
+    void (*detach)(struct limiter *l, struct target *t);
+    // cpu time of t in accounting units, return -1 when it exited
+    int (*sample)(struct limiter *l, struct target *t, long long *proc_time);
+    // all cpu time that passed on all cpus, same units
+    long long (*total)(struct limiter *l);
+    void (*signal)(struct limiter *l, struct target *t, int sig);
+    // percent t could use at most
+    double (*capacity)(struct limiter *l, struct target *t);
+    // move t to step level of the soft ladder, 0 restores it. NULL when
+    // the io has no scheduler
+    void (*demote)(struct limiter *l, struct target *t, int level);
+    // storage bytes t read and wrote so far, NULL when the io has none
+    int (*sample_io)(struct limiter *l, struct target *t,
+                     long long *read_bytes, long long *write_bytes);
+    // scan usage of every thread of t into t->threads, NULL when the io
+    // has no threads
+    void (*sample_threads)(struct limiter *l, struct target *t);
+    // monotonic ns
+    long long (*now)(struct limiter *l);
+};
+
+extern const struct limiter_io limiter_io_proc;
+
+struct control;
+struct policy;
+struct discover;
+struct budget;
+struct trace;
+struct status;
+struct elastic;
+
+// all targets share one /proc/stat read and one sleep per tick.
+struct limiter {
+    struct target *targets;
+    int ntargets, targets_cap;
+    int nalive;
+    long interval_ms;
+    // online cpus, /proc/stat and cpuclock usage are scaled by it
+    long nproc;
+    // cpus we may use: affinity and container quota, bounds group budgets
+    double capacity;
+    // wall time of last tick and seconds since the tick before it
+    long long last_tick_ns;
+    double tick_dt;
+    // absolute deadline of the next tick, ticks are every interval_ms from
+    // the first one however long sampling takes
+    long long next_tick_ns;
+    // ACCOUNTING_CPUCLOCK or ACCOUNTING_JIFFIES
+    int accounting;
+    struct proc_file proc_stat;
+    // control law of new targets
+    struct controller_conf controller;
+    // burst of new targets in cpu seconds, 0 for none
+    double burst;
+    // io limits of new targets in bytes per second, 0 for none
+    long long io_read_limit, io_write_limit;
+    // scheduling steps tried before stops, soft.nsteps 0 goes straight to
+    // the controller
+    struct soft_conf soft;
+    // horizons of new targets
+    struct horizon_conf horizons[MAX_HORIZONS];
+    int nhorizons;
+    // per thread usage is scanned this often, 0 never
+    long long threads_interval_ns;
+    // glob of thread names, when set the soft ladder moves only these
+    // threads and never ends in stops, the others keep full speed
+    const char *thread_match;
+    // a target stopped this long is continued, also between ticks. 0 lets
+    // stops last until the controller ends them
+    long long max_stop_ns;
+
+    // metrics of the limiter itself, see metrics.h
+    long ticks, missed_ticks;
+    long long tick_ns_sum, tick_ns_max;
+    // write metrics to metrics_path every metrics_interval_ms if set
+    const char *metrics_path;
+    long metrics_interval_ms;
+    long long last_metrics_ns;
+    // served while sleeping between ticks if set
+    struct control *control;
+    struct policy *policy;
+    // new processes matching the policy, when discovery is on
+    struct discover *discover;
+    // budget tree of target groups, usually owned by the policy
+    struct budget *budget;
+    // every sample and decision is appended here when set
+    struct trace *trace;
+    // state of every target is published here each tick when set
+    struct status *status;
+    // limits stretch up to a ceiling while the machine is not contended
+    struct elastic *elastic;
+    // limiter_io_proc unless simulated, io_ctx is for the io
+    const struct limiter_io *io;
+    void *io_ctx;
+    // keep running when no target is alive, targets come from the policy
+    int daemon;
+};
+
+int limiter_init(struct limiter *l, long interval_ms,
+                 const struct controller_conf *controller);
+
+// parse "auto", "cpuclock" or "jiffies" to l->accounting. auto uses cpu
+// clocks when the kernel lets us read them.
+int limiter_set_accounting(struct limiter *l, const char *name);
+void limiter_free(struct limiter *l);
+
+// add pid to the table, return the new target or NULL on failure.
+struct target *limiter_add(struct limiter *l, int pid, double percent,
+                           int tree);
+
+// stop limiting targets[idx], continue it if stopped and drop it from the
+// table. the last target is moved to idx.
+void limiter_remove(struct limiter *l, int idx);
+
+// parse "pid:percent[,pid:percent...]" and add each entry to the table.
+int limiter_add_list(struct limiter *l, const char *list, int tree);
+
+// get total cpu time of all cpus, jiffies from /proc/stat or monotonic ns
+// multiplied by number of cpus.
+long long get_total_cpu_usage(struct limiter *l);
+
+// sample every alive target against total_cpu_usage and send SIGSTOP or
+// SIGCONT. return number of alive targets.
+int limiter_tick(struct limiter *l, long long total_cpu_usage);
+
+// main loop, run ticks until every target exited or limiter_quit() is
+// called. stopped targets are continued before return.
+int limiter_run(struct limiter *l);
+
+// ask limiter_run() to return, async signal safe.
+void limiter_quit();
+
+// continue every target that is stopped now.
+void limiter_release(struct limiter *l);
+
+// print one line of counters per target.
+void limiter_report(struct limiter *l, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIMITER_H_ */
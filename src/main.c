@@ -1,21 +1,64 @@
 #define _POSIX_SOURCE
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 
 #include <errno.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
-#include <sys/sysinfo.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/types.h>
-#include <time.h>
 #include <unistd.h>
 
 #include "conf_parse.h"
+#include "control.h"
+#include "discover.h"
+#include "elastic.h"
+#include "limiter.h"
+#include "metrics.h"
+#include "policy.h"
+#include "status.h"
+#include "trace.h"
+
+#define MAX_TARGETS_LEN 4096
 
 struct my_conf {
     int pid;
-    int percent;
+    // limits in milli-percent and milli-cores
+    long long percent;
+    long long cores;
+    int tree;
+    char targets[MAX_TARGETS_LEN];
+    char controller[CONF_MAX_LINE_LEN];
+    char accounting[CONF_MAX_LINE_LEN];
     long interval_ms;
+    int report;
+    char metrics_file[CONF_MAX_LINE_LEN];
+    long metrics_interval_ms;
+    char control_socket[CONF_MAX_LINE_LEN];
+    char policy[CONF_MAX_LINE_LEN];
+    char discover[CONF_MAX_LINE_LEN];
+    long discover_interval_ms;
+    char trace_file[CONF_MAX_LINE_LEN];
+    long long trace_size;
+    char status_file[CONF_MAX_LINE_LEN];
+    long long burst;
+    long max_stop_ms;
+    int mlock;
+    int rt_priority;
+    char soft[CONF_MAX_LINE_LEN];
+    long soft_ms;
+    long long soft_release;
+    long threads_ms;
+    char horizons[CONF_MAX_LINE_LEN];
+    char thread_match[CONF_MAX_LINE_LEN];
+    int elastic;
+    long long elastic_ceiling;
+    long long elastic_pressure;
+    long elastic_ms;
+    long long io_read;
+    long long io_write;
 };
 
 static struct my_conf my_conf;
@@ -44,6 +87,8 @@ void usage(parse_command_t *cmds, char const *name) {
 // fork program and exec commands stored in argv, using environment same as
 // current process.
 // return pid of child on parent process
+// in tree mode the child leads a new process group, so the whole tree can be
+// stopped by one kill().
 int fork_exec(int argc, const char *argv[], char *envp[]) {
     int pid = 0;
     (void)argc;
@@ -54,121 +99,101 @@ int fork_exec(int argc, const char *argv[], char *envp[]) {
         return -1;
     }
     if (pid == 0) {
+        if (conf->tree) {
+            setpgid(0, 0);
+        }
         execve(argv[0], (char *const *)argv, envp);
         return 0;
     }
+    if (conf->tree) {
+        // also set in parent, avoid race with the first kill()
+        setpgid(pid, pid);
+    }
 
     return pid;
 }
 
-// get total cpu time jiffies
-long long get_total_cpu_usage() {
-    long long user, nice, system, idle;
-    FILE *fp = fopen("/proc/stat", "r");
-    if (fp == NULL) {
-        fprintf(stderr, "fopen(/proc/stat) failed: %s\n", strerror(errno));
-        return -1;
-    }
-    fscanf(fp, "cpu %lld %lld %lld %lld", &user, &nice, &system, &idle);
-    fclose(fp);
-    return user + nice + system + idle;
+static void on_quit_signal(int sig) {
+    (void)sig;
+    limiter_quit();
 }
 
-// we store time stats of process in a circular queue array, each element store
-// a struct time_history.
-struct time_history {
-    long utime, stime, cutime, cstime;
-    long long total_cpu_usage;
-};
-#define MAX_HISTORY_LEN 30
-struct time_history time_history[MAX_HISTORY_LEN];
-int cur_history_idx = 0;
-
-#define MAX_PATH_LEN 256
-
-// main loop, calculate current cpu time of process, send SIGSTOP or SIGCOND to
-// satisfy the limit.
-int loop(struct my_conf *conf) {
-    char stat_file[MAX_PATH_LEN];
-
-    long nproc = get_nprocs();
-
-    long long p_total_cpu_usage = 0;
-    long p_utime, p_stime, p_cutime, p_cstime;
-
-    long utime, stime, cutime, cstime;
-    long long starttime;
-
-    int full = 0;
-
-    int is_stop = 0;
-
-    sprintf(stat_file, "/proc/%d/stat", conf->pid);
-    for (;;) {
-        long long total_cpu_usage = get_total_cpu_usage();
+// stop limiting on SIGTERM/SIGINT, limiter_run() continues stopped targets
+// before returning so they are never left frozen.
+void install_signal_handlers() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_quit_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+}
 
-        FILE *fp = fopen(stat_file, "r");
-        if (fp == NULL) {
-            fprintf(stdout, "pid %d exited %s\n", conf->pid, strerror(errno));
+// keep our own timing under contention, as asked by --mlock and
+// --rt-priority. called after the target is spawned, so it never inherits
+// them.
+static int harden() {
+    if (conf->mlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "mlockall() failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (conf->rt_priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = conf->rt_priority;
+        if (sched_setscheduler(0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) <
+            0) {
+            fprintf(stderr, "SCHED_FIFO priority %d failed: %s\n",
+                    conf->rt_priority, strerror(errno));
             return -1;
         }
-        fscanf(fp,
-               "%*d %*s %*c %*d "  // pid,command,state,ppid
-               "%*d %*d %*d %*d %*u %*u %*u %*u %*u "
-               "%ld %ld %ld %ld "  // utime,stime,cutime,cstime
-               "%*d %*d %*d %*d "
-               "%lld",
-               &utime, &stime, &cutime, &cstime, &starttime);
-        fclose(fp);
-
-        struct time_history *th = &time_history[cur_history_idx];
-        th->utime = utime;
-        th->stime = stime;
-        th->cutime = cutime;
-        th->cstime = cstime;
-        th->total_cpu_usage = total_cpu_usage;
-
-        cur_history_idx++;
-        if (cur_history_idx >= MAX_HISTORY_LEN) {
-            cur_history_idx = 0;
-            full = 1;
-        }
-        if (!full) {
-            usleep(1000L * conf->interval_ms);
-            continue;
-        }
+    }
+    return 0;
+}
 
-        struct time_history *th_prev = &time_history[cur_history_idx];
-        p_utime = th_prev->utime;
-        p_stime = th_prev->stime;
-        p_cutime = th_prev->cutime;
-        p_cstime = th_prev->cstime;
-        p_total_cpu_usage = th_prev->total_cpu_usage;
-
-        long long proc_time_since = utime - p_utime + stime - p_stime + cutime -
-                                    p_cutime + cstime - p_cstime;
-        long long total_time_since = total_cpu_usage - p_total_cpu_usage;
-
-        double cpu_usage =
-            (proc_time_since * (double)100.0) / total_time_since * nproc;
-
-        if (cpu_usage >= conf->percent && !is_stop) {
-            kill(conf->pid, SIGSTOP);
-            is_stop = 1;
-#ifdef DEBUG
-            printf("STP:1 %lf >= %d\n", cpu_usage, conf->percent);
-#endif
-        }
-        if (cpu_usage < conf->percent && is_stop) {
-            kill(conf->pid, SIGCONT);
-            is_stop = 0;
-#ifdef DEBUG
-            printf("STP:0 %lf < %d\n", cpu_usage, conf->percent);
-#endif
+// run limiter until targets exit or we are asked to quit.
+int run_limiter(struct limiter *limiter) {
+    struct control control;
+    if (harden() < 0) {
+        limiter_release(limiter);
+        return -1;
+    }
+    if (conf->control_socket[0]) {
+        if (control_open(&control, conf->control_socket) < 0) {
+            limiter_release(limiter);
+            return -1;
         }
-
-        usleep(1000L * conf->interval_ms);
+        limiter->control = &control;
+    }
+    install_signal_handlers();
+    limiter_run(limiter);
+    if (limiter->control) {
+        control_close(limiter->control);
+        limiter->control = NULL;
+    }
+    if (conf->report) {
+        limiter_report(limiter, stderr);
+    }
+    if (limiter->metrics_path) {
+        metrics_write_file(limiter, limiter->metrics_path);
     }
+    if (limiter->discover) {
+        discover_close(limiter->discover);
+    }
+    if (limiter->policy) {
+        policy_close(limiter->policy);
+    }
+    if (limiter->trace) {
+        trace_close(limiter->trace);
+    }
+    if (limiter->status) {
+        status_close(limiter->status);
+    }
+    if (limiter->elastic) {
+        elastic_close(limiter->elastic);
+    }
+    limiter_free(limiter);
+    return 0;
 }
 
 int main(int argc, char const *argv[], char *envp[]) {
@@ -180,7 +205,119 @@ int main(int argc, char const *argv[], char *envp[]) {
             "spawn a new process and limit cpu usage of it, the program spawn "
             "and args follow by ' -- ' , for example: cpu_limit_run -- du -sh "
             "*"),
-        CONF_CMD_INT(conf, percent, "50", "maximun percent of cpu usage"),
+        CONF_CMD_MILLI(conf, percent, "50",
+                       "maximun percent of one cpu, may be fractional and "
+                       "above 100 for threaded programs, for example: 12.5"),
+        CONF_CMD_MILLI(conf, cores, "0",
+                       "maximun cpus to use instead of --percent, for "
+                       "example: 2.5"),
+        CONF_CMD_BOOL(conf, tree, "no",
+                      "limit the process and all of its descendants, their "
+                      "cpu usage are summed and they are stopped together"),
+        CONF_CMD_STR(conf, targets, "",
+                     "limit many processes in one cpu_limit_run, each with "
+                     "its own percent, for example: 1234:20,5678:2.5"),
+        CONF_CMD_STR(conf, controller, "threshold",
+                     "control law, threshold: stop when usage >= percent; "
+                     "pid[:kp,ki,kd]: pid around a computed duty cycle, "
+                     "default pid:0.005,0.02,0; pwm[:period]: run a computed "
+                     "part of every period ticks, default pwm:10"),
+        CONF_CMD_STR(conf, accounting, "auto",
+                     "how cpu time is measured, cpuclock: ns run time from "
+                     "the process cpu clock against monotonic time; jiffies: "
+                     "/proc/<pid>/stat against /proc/stat; auto: cpuclock "
+                     "if readable, else jiffies"),
+        CONF_CMD_INT(conf, interval_ms, "10",
+                     "sampling interval in milliseconds"),
+        CONF_CMD_BOOL(conf, report, "no",
+                      "print stop/continue counters of each target to stderr "
+                      "on exit"),
+        CONF_CMD_STR(conf, metrics_file, "",
+                     "rewrite prometheus text metrics to this file "
+                     "periodically, for the node_exporter textfile collector"),
+        CONF_CMD_INT(conf, metrics_interval_ms, "1000",
+                     "how often --metrics-file is rewritten"),
+        CONF_CMD_STR(conf, control_socket, "",
+                     "unix socket path to query and change limits at "
+                     "runtime, try: echo status | nc -U path"),
+        CONF_CMD_STR(conf, policy, "",
+                     "policy file mapping pid, command name or uid to "
+                     "limits, reloaded when it changes and runs until "
+                     "killed, lines: pid|comm|uid <who> <percent> [tree] "
+                     "or cmdline <percent> [tree] <pattern>, and budget "
+                     "groups: group <path> <cap> [weight]"),
+        CONF_CMD_STR(conf, discover, "",
+                     "limit every process whose command line matches this "
+                     "glob to --percent as it starts, with --tree if set, "
+                     "for example: 'java -jar batch*.jar'"),
+        CONF_CMD_INT(conf, discover_interval_ms, "1000",
+                     "how often /proc is scanned for new processes when the "
+                     "netlink proc connector can not be used"),
+        CONF_CMD_STR(conf, trace_file, "",
+                     "record every sample and stop/continue decision to this "
+                     "binary ring file, convert it with trace_convert"),
+        CONF_CMD_MEM(conf, trace_size, "64m",
+                     "size of --trace-file, oldest records are overwritten"),
+        CONF_CMD_MILLI(conf, burst, "0",
+                       "cpu seconds a target may run above --percent after "
+                       "it ran below it, e.g. 2 or 0.5. --percent is then "
+                       "the sustained rate of a token bucket"),
+        CONF_CMD_INT(conf, max_stop_ms, "0",
+                     "continue a target stopped this long even between "
+                     "ticks, throttling is then spread over many short "
+                     "stops. 0 for no bound"),
+        CONF_CMD_STR(conf, soft, "",
+                     "scheduling steps tried before SIGSTOP, e.g. "
+                     "nice:10,batch,idle. each thread of the target is moved "
+                     "one step down when usage stays over the limit"),
+        CONF_CMD_INT(conf, soft_ms, "500",
+                     "how long usage must stay over the limit to take the "
+                     "next --soft step, or under --soft-release to go back"),
+        CONF_CMD_MILLI(conf, soft_release, "90",
+                       "percent of the limit usage must stay under to undo "
+                       "a --soft step"),
+        CONF_CMD_INT(conf, threads_ms, "0",
+                     "scan the usage of every thread of the targets this "
+                     "often, shown by the threads control command and the "
+                     "metrics. 0 for never"),
+        CONF_CMD_STR(conf, thread_match, "",
+                     "glob of thread names, e.g. 'GC*'. only these threads "
+                     "are throttled, by the --soft steps, which must be "
+                     "given, and never by SIGSTOP, the others keep full "
+                     "speed"),
+        CONF_CMD_STR(conf, horizons, "",
+                     "more limits over longer windows, each stops the "
+                     "target on its own, e.g. 400@1s,150@10m. window in "
+                     "ms, s, m or h"),
+        CONF_CMD_MEM(conf, io_read, "0",
+                     "storage bytes per second the target may read, e.g. "
+                     "50m, enforced with the cpu limit. 0 for no limit"),
+        CONF_CMD_MEM(conf, io_write, "0",
+                     "storage bytes per second the target may write, e.g. "
+                     "20m. 0 for no limit"),
+        CONF_CMD_BOOL(conf, elastic, "no",
+                      "let targets use idle cpus: --percent is then the "
+                      "floor, held only while other work waits for a cpu "
+                      "according to /proc/pressure/cpu"),
+        CONF_CMD_MILLI(conf, elastic_ceiling, "0",
+                       "limit of --elastic targets on an idle machine, in "
+                       "percent. 0 for all cpus they may use"),
+        CONF_CMD_MILLI(conf, elastic_pressure, "10",
+                       "percent of time other work waits for a cpu at which "
+                       "--elastic limits are back at --percent"),
+        CONF_CMD_INT(conf, elastic_ms, "2000",
+                     "how fast --elastic limits follow changes of "
+                     "pressure, time constant in ms"),
+        CONF_CMD_BOOL(conf, mlock, "no",
+                      "lock the memory of cpu_limit_run, so ticks never wait "
+                      "for page faults"),
+        CONF_CMD_INT(conf, rt_priority, "0",
+                     "run cpu_limit_run as SCHED_FIFO with this priority "
+                     "(1-99), so a saturated host can not starve it. "
+                     "targets are not affected"),
+        CONF_CMD_STR(conf, status_file, "",
+                     "publish usage, limit and stop state of every target in "
+                     "this shared memory file, e.g. /dev/shm/cpu_limit_run"),
         CONF_CMD_END(),
     };
 
@@ -199,9 +336,137 @@ int main(int argc, char const *argv[], char *envp[]) {
         usage(cmds, argv[0]);
         return -1;
     }
-    conf->interval_ms = 10;
+    if (conf->interval_ms <= 0) {
+        fprintf(stderr, "--interval_ms must larger then 0\n");
+        return -1;
+    }
 
-    int pid = 0;
+    double percent = conf->cores > 0 ? conf->cores / 10.0
+                                     : conf->percent / 1000.0;
+    if (percent <= 0) {
+        fprintf(stderr, "--percent must larger then 0\n");
+        return -1;
+    }
+
+    struct controller_conf controller;
+    if (controller_parse(&controller, conf->controller) < 0) {
+        usage(cmds, argv[0]);
+        return -1;
+    }
+
+    struct limiter limiter;
+    if (limiter_init(&limiter, conf->interval_ms, &controller) < 0) {
+        return -1;
+    }
+    if (limiter_set_accounting(&limiter, conf->accounting) < 0) {
+        usage(cmds, argv[0]);
+        return -1;
+    }
+    limiter.burst = conf->burst / 1000.0;
+    limiter.io_read_limit = conf->io_read;
+    limiter.io_write_limit = conf->io_write;
+    if (conf->thread_match[0] && conf->soft[0] == '\0') {
+        // the ladder is all that throttles matched threads, it is not
+        // picked for the user
+        fprintf(stderr, "--thread-match needs --soft, e.g. --soft batch\n");
+        return -1;
+    }
+    if (soft_parse(&limiter.soft, conf->soft) < 0) {
+        usage(cmds, argv[0]);
+        return -1;
+    }
+    // targets usually have the nice of the limiter, spawned ones always
+    if (!soft_reversible(&limiter.soft, getpriority(PRIO_PROCESS, 0))) {
+        fprintf(stderr,
+                "--soft %s: SCHED_IDLE and nice steps cannot be undone "
+                "without CAP_SYS_NICE or a larger RLIMIT_NICE, use batch\n",
+                conf->soft);
+        return -1;
+    }
+    limiter.soft.hold_ns = conf->soft_ms * 1000000LL;
+    limiter.soft.release = conf->soft_release / 100000.0;
+    limiter.max_stop_ns = conf->max_stop_ms * 1000000LL;
+    limiter.threads_interval_ns = conf->threads_ms * 1000000LL;
+    limiter.nhorizons = horizon_parse(limiter.horizons, conf->horizons);
+    if (limiter.nhorizons < 0) {
+        usage(cmds, argv[0]);
+        return -1;
+    }
+    if (conf->thread_match[0]) {
+        limiter.thread_match = conf->thread_match;
+    }
+    if (conf->metrics_file[0]) {
+        limiter.metrics_path = conf->metrics_file;
+        limiter.metrics_interval_ms = conf->metrics_interval_ms;
+    }
+
+    struct trace trace;
+    if (conf->trace_file[0]) {
+        if (trace_open(&trace, conf->trace_file, conf->trace_size,
+                       limiter.nproc, limiter.accounting,
+                       conf->interval_ms) < 0) {
+            return -1;
+        }
+        limiter.trace = &trace;
+    }
+    struct elastic elastic;
+    if (conf->elastic) {
+        if (conf->elastic_pressure <= 0) {
+            fprintf(stderr, "--elastic-pressure must larger then 0\n");
+            return -1;
+        }
+        if (elastic_open(&elastic, conf->elastic_ceiling / 1000.0,
+                         conf->elastic_pressure / 100000.0,
+                         conf->elastic_ms) < 0) {
+            return -1;
+        }
+        limiter.elastic = &elastic;
+    }
+    struct status status;
+    if (conf->status_file[0]) {
+        if (status_open(&status, conf->status_file, conf->interval_ms) < 0) {
+            return -1;
+        }
+        limiter.status = &status;
+    }
+
+    if (conf->targets[0]) {
+        if (limiter_add_list(&limiter, conf->targets, conf->tree) < 0) {
+            usage(cmds, argv[0]);
+            return -1;
+        }
+    }
+    struct policy policy;
+    struct discover discover;
+    if (conf->policy[0] || conf->discover[0]) {
+        policy_init(&policy);
+        if (conf->discover[0]) {
+            struct policy_rule rule;
+            memset(&rule, 0, sizeof(rule));
+            rule.kind = RULE_CMDLINE;
+            rule.percent = percent;
+            rule.tree = conf->tree;
+            snprintf(rule.pattern, sizeof(rule.pattern), "%.*s",
+                     (int)sizeof(rule.pattern) - 1, conf->discover);
+            policy_add_rule(&policy, &rule);
+        }
+        if (conf->policy[0] && policy_open(&policy, conf->policy) < 0) {
+            return -1;
+        }
+        limiter.policy = &policy;
+        limiter.budget = &policy.budget;
+        limiter.daemon = 1;
+        // subscribe before the first scan, so no process falls in between
+        discover_open(&discover, &policy, conf->discover_interval_ms);
+        limiter.discover = &discover;
+        policy_apply(&policy, &limiter);
+    }
+    if ((conf->targets[0] || limiter.policy) && conf->pid == 0 &&
+        r_argc + 1 >= argc) {
+        return run_limiter(&limiter);
+    }
+
+    int pid = 0, spawned = 0;
     r_argc++;
     if (r_argc < argc) {
         pid = fork_exec(argc - r_argc, argv + r_argc, envp);
@@ -210,6 +475,7 @@ int main(int argc, char const *argv[], char *envp[]) {
         } else if (pid < 0) {
             return pid;
         }
+        spawned = 1;
     } else if (r_argc >= argc) {
         pid = conf->pid;
     }
@@ -221,12 +487,13 @@ int main(int argc, char const *argv[], char *envp[]) {
 
     conf->pid = pid;
 
-    if (conf->interval_ms <= 0) {
-        fprintf(stderr, "--interval_ms must larger then 0\n");
+    struct target *t = limiter_add(&limiter, conf->pid, percent, conf->tree);
+    if (t == NULL) {
         return -1;
     }
-
-    loop(conf);
-
-    return 0;
+    if (spawned && conf->tree) {
+        // fork_exec() made the group for the tree, it holds no one else
+        t->proc_tree.own_group = 1;
+    }
+    return run_limiter(&limiter);
 }
@@ -0,0 +1,272 @@
+/**
+ * @file metrics.c
+ * @brief prometheus text exposition of limiter counters.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "budget.h"
+
+#define MAX_PATH_LEN 4096
+
+#define PREFIX "cpu_limit_run_"
+
+static void write_header(FILE *out, const char *name, const char *type,
+                         const char *help) {
+    fprintf(out, "# HELP " PREFIX "%s %s\n", name, help);
+    fprintf(out, "# TYPE " PREFIX "%s %s\n", name, type);
+}
+
+// write s as a label value, escaped.
+static void write_label(FILE *out, const char *s) {
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', out);
+            fputc(*s, out);
+        } else if (*s == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*s, out);
+        }
+    }
+}
+
+// resident set size of the limiter in bytes, from /proc/self/statm
+static long long self_rss() {
+    long long size = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    fscanf(fp, "%lld %lld", &size, &resident);
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+void metrics_write(struct limiter *l, FILE *out) {
+    int i;
+    struct target *t;
+
+    write_header(out, "target_usage_percent", "gauge",
+                 "cpu usage of target over the history window");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_usage_percent{pid=\"%d\"} %.3f\n", t->pid,
+                t->usage);
+    }
+    write_header(out, "target_limit_percent", "gauge",
+                 "limit of target as configured");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_limit_percent{pid=\"%d\"} %.3f\n", t->pid,
+                t->percent);
+    }
+    write_header(out, "target_effective_limit_percent", "gauge",
+                 "limit enforced at the last tick: the configured one, the "
+                 "group budget or the elastic limit, at most capacity");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out,
+                PREFIX "target_effective_limit_percent{pid=\"%d\"} %.3f\n",
+                t->pid, t->limit);
+    }
+    write_header(out, "target_capacity_percent", "gauge",
+                 "cpu the target could use, from affinity and cgroup quota");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_capacity_percent{pid=\"%d\"} %.3f\n",
+                t->pid, t->capacity);
+    }
+    write_header(out, "target_stopped", "gauge",
+                 "1 if target is stopped now");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_stopped{pid=\"%d\"} %d\n", t->pid,
+                t->is_stop);
+    }
+    write_header(out, "target_soft_level", "gauge",
+                 "step of the --soft ladder, past it when stops are used");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_soft_level{pid=\"%d\"} %d\n", t->pid,
+                t->soft_level);
+    }
+    if (l->threads_interval_ns > 0) {
+        int j;
+        write_header(out, "thread_usage_percent", "gauge",
+                     "cpu usage of each thread of a target, with --threads-ms");
+        for (i = 0; i < l->ntargets; i++) {
+            t = &l->targets[i];
+            for (j = 0; j < t->threads.nthreads; j++) {
+                struct thread_stat *ts = &t->threads.threads[j];
+                fprintf(out,
+                        PREFIX "thread_usage_percent{pid=\"%d\",tid=\"%d\","
+                               "comm=\"",
+                        ts->pid, ts->tid);
+                write_label(out, ts->comm);
+                fprintf(out, "\",matched=\"%d\"} %.3f\n", ts->matched,
+                        ts->usage);
+            }
+        }
+    }
+    write_header(out, "target_horizon_usage_percent", "gauge",
+                 "cpu usage of target over each --horizons window");
+    for (i = 0; i < l->ntargets; i++) {
+        int j;
+        t = &l->targets[i];
+        for (j = 0; j < t->nhorizons; j++) {
+            fprintf(out,
+                    PREFIX "target_horizon_usage_percent{pid=\"%d\","
+                           "window_seconds=\"%g\"} %.3f\n",
+                    t->pid, t->horizons[j].conf.window_ns / 1e9,
+                    horizon_share(&t->horizons[j]) * 100 * l->nproc);
+        }
+    }
+    write_header(out, "target_horizon_limit_percent", "gauge",
+                 "limit of each --horizons window, enforced next to the "
+                 "effective limit");
+    for (i = 0; i < l->ntargets; i++) {
+        int j;
+        t = &l->targets[i];
+        for (j = 0; j < t->nhorizons; j++) {
+            fprintf(out,
+                    PREFIX "target_horizon_limit_percent{pid=\"%d\","
+                           "window_seconds=\"%g\"} %.3f\n",
+                    t->pid, t->horizons[j].conf.window_ns / 1e9,
+                    t->horizons[j].conf.limit);
+        }
+    }
+    write_header(out, "target_horizon_stops_total", "counter",
+                 "times a --horizons window went over its limit");
+    for (i = 0; i < l->ntargets; i++) {
+        int j;
+        t = &l->targets[i];
+        for (j = 0; j < t->nhorizons; j++) {
+            fprintf(out,
+                    PREFIX "target_horizon_stops_total{pid=\"%d\","
+                           "window_seconds=\"%g\"} %ld\n",
+                    t->pid, t->horizons[j].conf.window_ns / 1e9,
+                    t->horizons[j].nstop);
+        }
+    }
+    write_header(out, "target_stopped_seconds_total", "counter",
+                 "time target spent stopped");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_stopped_seconds_total{pid=\"%d\"} %.3f\n",
+                t->pid, t->stopped_seconds);
+    }
+    write_header(out, "target_stops_total", "counter", "SIGSTOP sent");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_stops_total{pid=\"%d\"} %ld\n", t->pid,
+                t->nstop);
+    }
+    write_header(out, "target_stops_by_cause_total", "counter",
+                 "SIGSTOP sent for each resource over its limit");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out,
+                PREFIX "target_stops_by_cause_total{pid=\"%d\",cause=\"cpu\"} "
+                       "%ld\n",
+                t->pid, t->nstop_cpu);
+        fprintf(out,
+                PREFIX "target_stops_by_cause_total{pid=\"%d\","
+                       "cause=\"io_read\"} %ld\n",
+                t->pid, t->nstop_io_read);
+        fprintf(out,
+                PREFIX "target_stops_by_cause_total{pid=\"%d\","
+                       "cause=\"io_write\"} %ld\n",
+                t->pid, t->nstop_io_write);
+    }
+    write_header(out, "target_io_read_bytes_per_second", "gauge",
+                 "storage read rate over the history window, with io limits");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out,
+                PREFIX "target_io_read_bytes_per_second{pid=\"%d\"} %.0f\n",
+                t->pid, t->read_rate);
+    }
+    write_header(out, "target_io_write_bytes_per_second", "gauge",
+                 "storage write rate over the history window, with io limits");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out,
+                PREFIX "target_io_write_bytes_per_second{pid=\"%d\"} %.0f\n",
+                t->pid, t->write_rate);
+    }
+    write_header(out, "target_conts_total", "counter", "SIGCONT sent");
+    for (i = 0; i < l->ntargets; i++) {
+        t = &l->targets[i];
+        fprintf(out, PREFIX "target_conts_total{pid=\"%d\"} %ld\n", t->pid,
+                t->ncont);
+    }
+
+    if (l->budget && l->budget->ngroups > 0) {
+        struct budget *b = l->budget;
+        write_header(out, "group_usage_percent", "gauge",
+                     "cpu usage of budget group members");
+        for (i = 0; i < b->ngroups; i++) {
+            fprintf(out, PREFIX "group_usage_percent{group=\"");
+            write_label(out, b->groups[i].name);
+            fprintf(out, "\"} %.3f\n", b->groups[i].usage);
+        }
+        write_header(out, "group_budget_percent", "gauge",
+                     "share of the parent budget given to the group");
+        for (i = 0; i < b->ngroups; i++) {
+            fprintf(out, PREFIX "group_budget_percent{group=\"");
+            write_label(out, b->groups[i].name);
+            fprintf(out, "\"} %.3f\n", b->groups[i].alloc);
+        }
+    }
+
+    write_header(out, "targets_alive", "gauge", "targets not exited");
+    fprintf(out, PREFIX "targets_alive %d\n", l->nalive);
+    write_header(out, "ticks_total", "counter", "sampling ticks");
+    fprintf(out, PREFIX "ticks_total %ld\n", l->ticks);
+    write_header(out, "missed_ticks_total", "counter",
+                 "ticks skipped because the limiter woke up late");
+    fprintf(out, PREFIX "missed_ticks_total %ld\n", l->missed_ticks);
+    write_header(out, "tick_seconds", "summary",
+                 "time spent sampling and deciding in one tick");
+    fprintf(out, PREFIX "tick_seconds_sum %.9f\n", l->tick_ns_sum / 1e9);
+    fprintf(out, PREFIX "tick_seconds_count %ld\n", l->ticks);
+    write_header(out, "tick_seconds_max", "gauge", "slowest tick");
+    fprintf(out, PREFIX "tick_seconds_max %.9f\n", l->tick_ns_max / 1e9);
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    write_header(out, "cpu_seconds_total", "counter",
+                 "cpu time used by the limiter");
+    fprintf(out, PREFIX "cpu_seconds_total %.6f\n",
+            ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    write_header(out, "resident_bytes", "gauge",
+                 "resident memory of the limiter");
+    fprintf(out, PREFIX "resident_bytes %lld\n", self_rss());
+}
+
+int metrics_write_file(struct limiter *l, const char *path) {
+    char tmp[MAX_PATH_LEN];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "fopen(%s) failed: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    metrics_write(l, fp);
+    if (fclose(fp) != 0 || rename(tmp, path) < 0) {
+        fprintf(stderr, "write %s failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/**
+ * @file metrics.h
+ * @brief export counters of the limiter and its targets as prometheus text.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdio.h>
+
+#include "limiter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// write all metrics in prometheus text format. own cpu time and rss are
+// read here, never on the tick path.
+void metrics_write(struct limiter *l, FILE *out);
+
+// write metrics to path.tmp then rename it to path, readers never see a
+// half written file.
+int metrics_write_file(struct limiter *l, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H_ */
@@ -0,0 +1,417 @@
+/**
+ * @file policy.c
+ * @brief policy rules parsed with conf_parse and applied as a diff.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "policy.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "conf_parse.h"
+#include "sample.h"
+
+#define MAX_PATH_LEN 256
+
+static int push_rule(struct policy *p, const struct policy_rule *r) {
+    if (p->nrules == p->rules_cap) {
+        int cap = p->rules_cap ? p->rules_cap * 2 : 16;
+        struct policy_rule *rules =
+            realloc(p->rules, cap * sizeof(struct policy_rule));
+        if (rules == NULL) {
+            return -1;
+        }
+        p->rules = rules;
+        p->rules_cap = cap;
+    }
+    p->rules[p->nrules++] = *r;
+    if (r->kind == RULE_CMDLINE) {
+        p->has_cmdline = 1;
+    }
+    return 0;
+}
+
+// parse flags following the percent of a rule: tree, group=<path> and
+// weight=<w>, return where the flags end.
+static const char *parse_flags(struct policy *p, struct policy_rule *r,
+                               const char *v) {
+    char word[POLICY_MAX_PATTERN];
+    int n;
+    for (;;) {
+        while (*v == ' ' || *v == '\t') v++;
+        if (sscanf(v, "%255s%n", word, &n) < 1) {
+            return v;
+        }
+        if (strcmp(word, "tree") == 0) {
+            r->tree = 1;
+        } else if (strncmp(word, "group=", 6) == 0 &&
+                   budget_find(&p->budget, word + 6) >= 0) {
+            snprintf(r->group, sizeof(r->group), "%.*s",
+                     (int)sizeof(r->group) - 1, word + 6);
+        } else if (strncmp(word, "weight=", 7) == 0 && atof(word + 7) > 0) {
+            r->weight = atof(word + 7);
+        } else {
+            return v;
+        }
+        v += n;
+    }
+}
+
+// parse "<who> <percent> [flags]" of a rule line, or
+// "<percent> [flags] <pattern>" of a cmdline rule.
+static int parse_rule(struct policy *p, int kind, void *value) {
+    struct policy_rule r;
+    char who[POLICY_MAX_PATTERN];
+    const char *v = value;
+    int n = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.kind = kind;
+    r.weight = 1;
+    if (v == NULL) {
+        printf("empty policy rule\n");
+        return -1;
+    }
+    if (kind == RULE_CMDLINE) {
+        if (sscanf(v, "%lf%n", &r.percent, &n) == 1) {
+            v = parse_flags(p, &r, v + n);
+            snprintf(r.pattern, sizeof(r.pattern), "%s", v);
+        }
+    } else if (sscanf(v, "%255s %lf%n", who, &r.percent, &n) == 2) {
+        v = parse_flags(p, &r, v + n);
+        // anything left is an unknown flag or group
+        if (*v == '\0') {
+            snprintf(r.pattern, sizeof(r.pattern), "%s", who);
+            r.pid = atoi(who);
+            r.uid = atoi(who);
+        }
+    }
+    if (r.percent <= 0 || r.pattern[0] == '\0') {
+        printf("invalid policy rule: %s\n", (char *)value);
+        return -1;
+    }
+    return push_rule(p, &r);
+}
+
+// parse "<path> <cap percent> [weight]" of a group line.
+static int parse_group(void *addr, size_t addr_cap, void *value,
+                       size_t value_len) {
+    struct policy *p = addr;
+    char path[BUDGET_MAX_NAME];
+    double cap, weight = 1;
+    (void)addr_cap;
+    (void)value_len;
+    if (value == NULL ||
+        sscanf(value, "%63s %lf %lf", path, &cap, &weight) < 2 ||
+        budget_add_group(&p->budget, path, cap, weight) < 0) {
+        printf("invalid policy group: %s\n", value ? (char *)value : "");
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_pid_rule(void *addr, size_t addr_cap, void *value,
+                          size_t value_len) {
+    (void)addr_cap;
+    (void)value_len;
+    return parse_rule(addr, RULE_PID, value);
+}
+
+static int parse_comm_rule(void *addr, size_t addr_cap, void *value,
+                           size_t value_len) {
+    (void)addr_cap;
+    (void)value_len;
+    return parse_rule(addr, RULE_COMM, value);
+}
+
+static int parse_cmdline_rule(void *addr, size_t addr_cap, void *value,
+                              size_t value_len) {
+    (void)addr_cap;
+    (void)value_len;
+    return parse_rule(addr, RULE_CMDLINE, value);
+}
+
+static int parse_uid_rule(void *addr, size_t addr_cap, void *value,
+                          size_t value_len) {
+    (void)addr_cap;
+    (void)value_len;
+    return parse_rule(addr, RULE_UID, value);
+}
+
+// parse the file into a new rule table, replace the current one only when
+// the whole file is valid.
+static int policy_load(struct policy *p) {
+    struct policy next;
+    struct stat st;
+    int i;
+    memset(&next, 0, sizeof(next));
+    for (i = 0; i < p->nstatic; i++) {
+        push_rule(&next, &p->rules[i]);
+    }
+
+    parse_command_t cmds[] = {
+        {"include", conf_do_include, NULL, 0, NULL, 0,
+         "include policy file"},
+        {"pid", parse_pid_rule, &next, 0, NULL, 0, "pid rule"},
+        {"comm", parse_comm_rule, &next, 0, NULL, 0, "command name rule"},
+        {"uid", parse_uid_rule, &next, 0, NULL, 0, "uid rule"},
+        {"cmdline", parse_cmdline_rule, &next, 0, NULL, 0, "cmdline rule"},
+        {"group", parse_group, &next, 0, NULL, 0, "budget group"},
+        CONF_CMD_END(),
+    };
+    cmds[0].addr = cmds;
+
+    if (conf_parse_file(cmds, p->path) < 0) {
+        fprintf(stderr, "load policy %s failed, keep old rules\n", p->path);
+        free(next.rules);
+        budget_free(&next.budget);
+        return -1;
+    }
+    // a file of zero bytes is more likely one being rewritten, by
+    // '> file' or an editor, than a wish to detach every target. rules are
+    // dropped on purpose by a file with nothing but comments
+    if (next.nrules == p->nstatic && p->nrules > p->nstatic &&
+        stat(p->path, &st) == 0 && st.st_size == 0) {
+        fprintf(stderr,
+                "policy %s is empty, keep old rules. leave a comment in it "
+                "to drop them\n",
+                p->path);
+        free(next.rules);
+        budget_free(&next.budget);
+        return -1;
+    }
+    free(p->rules);
+    budget_free(&p->budget);
+    p->budget = next.budget;
+    p->rules = next.rules;
+    p->nrules = next.nrules;
+    p->rules_cap = next.rules_cap;
+    p->has_cmdline = next.has_cmdline;
+    return 0;
+}
+
+void policy_init(struct policy *p) {
+    memset(p, 0, sizeof(*p));
+    p->inotify_fd = -1;
+}
+
+int policy_add_rule(struct policy *p, const struct policy_rule *r) {
+    // keep static rules in front of the ones from the file
+    if (push_rule(p, r) < 0) {
+        return -1;
+    }
+    struct policy_rule added = p->rules[p->nrules - 1];
+    memmove(&p->rules[p->nstatic + 1], &p->rules[p->nstatic],
+            (p->nrules - 1 - p->nstatic) * sizeof(struct policy_rule));
+    p->rules[p->nstatic++] = added;
+    return 0;
+}
+
+int policy_open(struct policy *p, const char *path) {
+    char dir[POLICY_MAX_PATH];
+
+    snprintf(p->path, sizeof(p->path), "%s", path);
+    if (policy_load(p) < 0) {
+        return -1;
+    }
+
+    const char *slash = strrchr(path, '/');
+    if (slash) {
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path + 1), path);
+        snprintf(p->name, sizeof(p->name), "%s", slash + 1);
+    } else {
+        snprintf(dir, sizeof(dir), ".");
+        snprintf(p->name, sizeof(p->name), "%s", path);
+    }
+    p->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (p->inotify_fd < 0 ||
+        inotify_add_watch(p->inotify_fd, dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "watch %s failed: %s, policy is not reloaded\n", dir,
+                strerror(errno));
+    }
+    return 0;
+}
+
+void policy_close(struct policy *p) {
+    if (p->inotify_fd >= 0) {
+        close(p->inotify_fd);
+    }
+    free(p->rules);
+    budget_free(&p->budget);
+    memset(p, 0, sizeof(*p));
+    p->inotify_fd = -1;
+}
+
+const struct policy_rule *policy_match(struct policy *p, int pid,
+                                       const char *comm, int uid,
+                                       const char *cmdline) {
+    static const int order[] = {RULE_PID, RULE_CMDLINE, RULE_COMM, RULE_UID};
+    int k, i;
+    for (k = 0; k < 4; k++) {
+        for (i = 0; i < p->nrules; i++) {
+            struct policy_rule *r = &p->rules[i];
+            if (r->kind != order[k]) {
+                continue;
+            }
+            if ((r->kind == RULE_PID && r->pid == pid) ||
+                (r->kind == RULE_CMDLINE && cmdline &&
+                 fnmatch(r->pattern, cmdline, 0) == 0) ||
+                (r->kind == RULE_COMM && fnmatch(r->pattern, comm, 0) == 0) ||
+                (r->kind == RULE_UID && r->uid == uid)) {
+                return r;
+            }
+        }
+    }
+    return NULL;
+}
+
+// read /proc/<pid>/cmdline with arguments joined by spaces.
+static int read_cmdline(int pid, char *buf, int cap) {
+    char path[MAX_PATH_LEN];
+    int i;
+    sprintf(path, "/proc/%d/cmdline", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, cap - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    // drop trailing '\0' and join arguments
+    while (n > 0 && buf[n - 1] == '\0') n--;
+    for (i = 0; i < n; i++) {
+        if (buf[i] == '\0') {
+            buf[i] = ' ';
+        }
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+static struct target *find_target(struct limiter *l, int pid) {
+    int i;
+    for (i = 0; i < l->ntargets; i++) {
+        if (l->targets[i].pid == pid && !l->targets[i].exited) {
+            return &l->targets[i];
+        }
+    }
+    return NULL;
+}
+
+// match pid and attach, update or keep its target, NULL if pid is not a
+// policy target.
+static struct target *attach_pid(struct policy *p, struct limiter *l,
+                                 int pid) {
+    char path[MAX_PATH_LEN];
+    char cmdline[POLICY_MAX_PATTERN * 4];
+    struct pid_stat st;
+    struct stat sb;
+
+    // never limit ourself or kernel threads
+    if (pid == getpid() || pid == 2 || read_pid_stat(pid, &st) < 0 ||
+        st.ppid == 2) {
+        return NULL;
+    }
+    sprintf(path, "/proc/%d", pid);
+    if (stat(path, &sb) < 0) {
+        return NULL;
+    }
+    if (p->has_cmdline && read_cmdline(pid, cmdline, sizeof(cmdline)) < 0) {
+        return NULL;
+    }
+    const struct policy_rule *r = policy_match(
+        p, pid, st.comm, sb.st_uid, p->has_cmdline ? cmdline : NULL);
+    struct target *t = find_target(l, pid);
+    if ((t && !t->policy) || r == NULL) {
+        return NULL;
+    }
+    if (t != NULL && t->tree != r->tree) {
+        // tree mode changes what is measured, start the target over
+        limiter_remove(l, t - l->targets);
+        t = NULL;
+    }
+    if (t == NULL) {
+        t = limiter_add(l, pid, r->percent, r->tree);
+        if (t == NULL) {
+            return NULL;
+        }
+        t->policy = 1;
+    } else {
+        t->percent = r->percent;
+    }
+    // group indexes change when the file is reloaded
+    t->group = r->group[0] ? budget_find(&p->budget, r->group) : -1;
+    t->weight = r->weight;
+    t->seen = 1;
+    return t;
+}
+
+int policy_check_pid(struct policy *p, struct limiter *l, int pid) {
+    return attach_pid(p, l, pid) != NULL;
+}
+
+int policy_apply(struct policy *p, struct limiter *l) {
+    DIR *dir = opendir("/proc");
+    struct dirent *ent;
+    int i;
+
+    if (dir == NULL) {
+        return -1;
+    }
+    for (i = 0; i < l->ntargets; i++) {
+        l->targets[i].seen = 0;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        attach_pid(p, l, atoi(ent->d_name));
+    }
+    closedir(dir);
+
+    // detach targets no rule matches any more
+    for (i = l->ntargets - 1; i >= 0; i--) {
+        if (l->targets[i].policy && !l->targets[i].seen) {
+            limiter_remove(l, i);
+        }
+    }
+    return 0;
+}
+
+int policy_handle(struct policy *p, struct limiter *l) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t n;
+
+    while ((n = read(p->inotify_fd, buf, sizeof(buf))) > 0) {
+        char *ptr = buf;
+        while (ptr < buf + n) {
+            struct inotify_event *ev = (struct inotify_event *)ptr;
+            if (ev->len && strcmp(ev->name, p->name) == 0) {
+                changed = 1;
+            }
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (!changed) {
+        return 0;
+    }
+    if (policy_load(p) < 0) {
+        return -1;
+    }
+    fprintf(stdout, "policy %s reloaded, %d rules\n", p->path, p->nrules);
+    return policy_apply(p, l);
+}
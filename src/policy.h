@@ -0,0 +1,91 @@
+/**
+ * @file policy.h
+ * @brief policy file mapping processes to limits, reloaded on change.
+ */
+
+#ifndef POLICY_H_
+#define POLICY_H_
+
+#include "budget.h"
+#include "limiter.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define POLICY_MAX_PATH 4096
+#define POLICY_MAX_PATTERN 256
+
+#define RULE_PID 0
+#define RULE_COMM 1
+#define RULE_UID 2
+#define RULE_CMDLINE 3
+
+// one line of the policy file, parsed by conf_parse_file():
+//   pid     <pid>  <percent> [tree]
+//   comm    <glob> <percent> [tree]
+//   uid     <uid>  <percent> [tree]
+//   cmdline <percent> [tree] <glob of the whole command line>
+//   group   <path> <cap percent> [weight]
+//   include <file>
+// a process gets the first matching pid rule, else cmdline, comm and uid
+// rules in that order. tree may be followed by group=<path> and weight=<w>
+// to share the group budget, percent then caps the process alone.
+struct policy_rule {
+    int kind;
+    int pid;
+    int uid;
+    // comm or cmdline glob, see fnmatch(3)
+    char pattern[POLICY_MAX_PATTERN];
+    double percent;
+    int tree;
+    char group[BUDGET_MAX_NAME];
+    double weight;
+};
+
+struct policy {
+    char path[POLICY_MAX_PATH];
+    struct policy_rule *rules;
+    int nrules, rules_cap;
+    // rules[0, nstatic) come from the command line and survive reloads
+    int nstatic;
+    int has_cmdline;
+    // groups of the file, members point into it by index
+    struct budget budget;
+    // watch the directory, editors often replace the file by rename
+    int inotify_fd;
+    char name[POLICY_MAX_PATH];
+};
+
+// init policy without a file, rules are added by policy_add_rule().
+void policy_init(struct policy *p);
+// load path and start watching it, return 0 on success.
+int policy_open(struct policy *p, const char *path);
+// add a rule not from the file, it is kept when the file reloads.
+int policy_add_rule(struct policy *p, const struct policy_rule *r);
+void policy_close(struct policy *p);
+
+// attach processes matching the rules, update limits of attached ones and
+// detach ones no rule matches any more. targets not added by the policy are
+// never touched, unchanged targets keep their history.
+int policy_apply(struct policy *p, struct limiter *l);
+
+// find the rule for a process, NULL if none matches. cmdline has its
+// arguments joined by spaces, it may be NULL when p->has_cmdline is 0.
+const struct policy_rule *policy_match(struct policy *p, int pid,
+                                       const char *comm, int uid,
+                                       const char *cmdline);
+
+// match a single process against the rules and attach or update it.
+// return 1 if pid is a policy target now.
+int policy_check_pid(struct policy *p, struct limiter *l, int pid);
+
+// consume inotify events, reload and apply if the file changed.
+// a file that fails to parse is ignored and the old rules stay.
+int policy_handle(struct policy *p, struct limiter *l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* POLICY_H_ */
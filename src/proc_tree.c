@@ -0,0 +1,503 @@
+/**
+ * @file proc_tree.c
+ * @brief find descendants of a process and sum their cpu time.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "proc_tree.h"
+
+#include "sample.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 256
+// /proc files a tree keeps open, a tree with more threads reads the rest
+// with open, read and close.
+#define PROC_TREE_MAX_FDS 512
+
+static int push_member(struct proc_tree *tree, int pid) {
+    if (tree->nmembers == tree->members_cap) {
+        int cap = tree->members_cap ? tree->members_cap * 2 : 64;
+        struct tree_member *m =
+            realloc(tree->members, cap * sizeof(struct tree_member));
+        if (m == NULL) {
+            return -1;
+        }
+        tree->members = m;
+        tree->members_cap = cap;
+    }
+    tree->members[tree->nmembers].pid = pid;
+    tree->members[tree->nmembers].pgrp = 0;
+    tree->members[tree->nmembers].time = 0;
+    tree->nmembers++;
+    return 0;
+}
+
+// children file of one thread of a member.
+struct task_file {
+    int tid;
+    int fd;
+    int seen;
+};
+
+// /proc files of one member kept open across updates, so an update costs a
+// pread() per file instead of open, read and close. files past
+// PROC_TREE_MAX_FDS stay closed and are opened for each read instead.
+struct member_files {
+    int pid;
+    int seen;
+    DIR *task;
+    struct proc_file stat;
+    struct task_file *tasks;
+    int ntasks, tasks_cap;
+};
+
+static int cmp_files(const void *a, const void *b) {
+    const struct member_files *fa = a, *fb = b;
+    return fa->pid - fb->pid;
+}
+
+static int cmp_task(const void *a, const void *b) {
+    const struct task_file *ta = a, *tb = b;
+    return ta->seen - tb->seen;
+}
+
+static void open_member(struct proc_tree *tree, struct member_files *f) {
+    char path[MAX_PATH_LEN];
+    if (tree->nfds + 2 > PROC_TREE_MAX_FDS) {
+        return;
+    }
+    sprintf(path, "/proc/%d/stat", f->pid);
+    if (proc_file_open(&f->stat, path) == 0) {
+        tree->nfds++;
+    }
+    if (tree->has_children_file) {
+        sprintf(path, "/proc/%d/task", f->pid);
+        if ((f->task = opendir(path)) != NULL) {
+            tree->nfds++;
+        }
+    }
+}
+
+static void close_member(struct proc_tree *tree, struct member_files *f) {
+    int i;
+    if (f->stat.fd >= 0) {
+        proc_file_close(&f->stat);
+        tree->nfds--;
+    }
+    if (f->task != NULL) {
+        closedir(f->task);
+        f->task = NULL;
+        tree->nfds--;
+    }
+    for (i = 0; i < f->ntasks; i++) {
+        if (f->tasks[i].fd >= 0) {
+            close(f->tasks[i].fd);
+            tree->nfds--;
+        }
+    }
+    f->ntasks = 0;
+}
+
+// files of pid, opened when pid is new to the tree. entries appended since
+// the last sweep sit unsorted after nsorted.
+static struct member_files *member_files(struct proc_tree *tree, int pid) {
+    struct member_files key, *f;
+    int i;
+
+    key.pid = pid;
+    f = bsearch(&key, tree->files, tree->nsorted, sizeof(*f), cmp_files);
+    for (i = tree->nsorted; f == NULL && i < tree->nfiles; i++) {
+        if (tree->files[i].pid == pid) {
+            f = &tree->files[i];
+        }
+    }
+    if (f == NULL) {
+        if (tree->nfiles == tree->files_cap) {
+            int cap = tree->files_cap ? tree->files_cap * 2 : 64;
+            f = realloc(tree->files, cap * sizeof(*f));
+            if (f == NULL) {
+                return NULL;
+            }
+            tree->files = f;
+            tree->files_cap = cap;
+        }
+        f = &tree->files[tree->nfiles++];
+        memset(f, 0, sizeof(*f));
+        f->pid = pid;
+        f->stat.fd = -1;
+        open_member(tree, f);
+    } else if (f->stat.fd < 0) {
+        // closed for the fd limit before, or a failed reopen
+        close_member(tree, f);
+        open_member(tree, f);
+    }
+    f->seen = 1;
+    return f;
+}
+
+// close files of processes that left the tree, sort the new ones in.
+static void sweep_files(struct proc_tree *tree) {
+    int i, n = 0;
+    for (i = 0; i < tree->nfiles; i++) {
+        struct member_files *f = &tree->files[i];
+        if (!f->seen) {
+            close_member(tree, f);
+            free(f->tasks);
+            continue;
+        }
+        f->seen = 0;
+        tree->files[n++] = *f;
+    }
+    tree->nfiles = n;
+    if (tree->nsorted < n) {
+        qsort(tree->files, n, sizeof(struct member_files), cmp_files);
+    }
+    tree->nsorted = n;
+}
+
+// append pids of a children file, read with pread() from offset 0 since
+// the kernel regenerates the list on every read.
+static int read_children(struct proc_tree *tree, int fd) {
+    char buf[PROC_FILE_BUF_LEN];
+    off_t off = 0;
+    int child = 0, digits = 0;
+
+    for (;;) {
+        ssize_t i, n = pread(fd, buf, sizeof(buf), off);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (buf[i] >= '0' && buf[i] <= '9') {
+                child = child * 10 + buf[i] - '0';
+                digits = 1;
+            } else if (digits) {
+                push_member(tree, child);
+                child = digits = 0;
+            }
+        }
+        off += n;
+    }
+    if (digits) {
+        push_member(tree, child);
+    }
+    return 0;
+}
+
+static struct task_file *task_file(struct proc_tree *tree,
+                                   struct member_files *f, int tid,
+                                   int *hint) {
+    char path[MAX_PATH_LEN];
+    struct task_file *t;
+    int i;
+
+    // threads are listed in the same order on every update
+    for (i = 0; i < f->ntasks; i++) {
+        t = &f->tasks[(*hint + i) % f->ntasks];
+        if (t->tid == tid) {
+            *hint = (*hint + i + 1) % f->ntasks;
+            return t;
+        }
+    }
+    if (f->ntasks == f->tasks_cap) {
+        int cap = f->tasks_cap ? f->tasks_cap * 2 : 4;
+        t = realloc(f->tasks, cap * sizeof(*t));
+        if (t == NULL) {
+            return NULL;
+        }
+        f->tasks = t;
+        f->tasks_cap = cap;
+    }
+    t = &f->tasks[f->ntasks++];
+    t->tid = tid;
+    t->fd = -1;
+    if (tree->nfds < PROC_TREE_MAX_FDS) {
+        sprintf(path, "/proc/%d/task/%d/children", f->pid, tid);
+        if ((t->fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            tree->nfds++;
+        }
+    }
+    return t;
+}
+
+// append children of a member listed in /proc/<pid>/task/<tid>/children.
+// return -1 when the task directory lists no thread, the process exited
+// or the pid was reused since the directory was opened.
+static int push_children(struct proc_tree *tree, struct member_files *f) {
+    char path[MAX_PATH_LEN];
+    DIR *dir = f->task;
+    struct dirent *ent;
+    int i, n = 0, order = 0, hint = 0, moved = 0;
+
+    if (dir != NULL) {
+        rewinddir(dir);
+    } else {
+        sprintf(path, "/proc/%d/task", f->pid);
+        if ((dir = opendir(path)) == NULL) {
+            return -1;
+        }
+    }
+    for (i = 0; i < f->ntasks; i++) {
+        f->tasks[i].seen = 0;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        struct task_file *t;
+        int tid, fd;
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        tid = atoi(ent->d_name);
+        order++;
+        t = task_file(tree, f, tid, &hint);
+        if (t != NULL) {
+            moved |= t - f->tasks != order - 1;
+            t->seen = order;
+            fd = t->fd;
+        } else {
+            fd = -1;
+        }
+        if (fd >= 0) {
+            read_children(tree, fd);
+            continue;
+        }
+        sprintf(path, "/proc/%d/task/%d/children", f->pid, tid);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+            read_children(tree, fd);
+            close(fd);
+        }
+    }
+    if (dir != f->task) {
+        closedir(dir);
+    }
+
+    // drop exited threads, keep the rest in directory order
+    for (i = 0; i < f->ntasks; i++) {
+        struct task_file *t = &f->tasks[i];
+        if (!t->seen) {
+            if (t->fd >= 0) {
+                close(t->fd);
+                tree->nfds--;
+            }
+            moved = 1;
+            continue;
+        }
+        f->tasks[n++] = *t;
+    }
+    f->ntasks = n;
+    if (moved) {
+        qsort(f->tasks, n, sizeof(struct task_file), cmp_task);
+    }
+    return order > 0 ? 0 : -1;
+}
+
+// read stat of a member through its kept file, reopened once when the
+// read fails since the pid may belong to a new process by now.
+static int read_member_stat(struct proc_tree *tree, int pid,
+                            struct pid_stat *st) {
+    struct member_files *f = member_files(tree, pid);
+    if (f == NULL || f->stat.fd < 0) {
+        return read_pid_stat(pid, st);
+    }
+    if (proc_file_read(&f->stat) < 0) {
+        close_member(tree, f);
+        open_member(tree, f);
+        if (proc_file_read(&f->stat) < 0) {
+            return -1;
+        }
+    }
+    return parse_pid_stat(f->stat.buf, st);
+}
+
+struct pid_ppid {
+    int pid, ppid;
+};
+
+// fallback of push_children for kernels without CONFIG_PROC_CHILDREN, scan
+// whole /proc and collect descendants of root by ppid.
+static int scan_all_descendants(struct proc_tree *tree) {
+    DIR *dir = opendir("/proc");
+    struct dirent *ent;
+    struct pid_ppid *all = NULL;
+    int nall = 0, cap = 0;
+    int i, j;
+
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        struct pid_stat st;
+        int pid;
+        if (ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+            continue;
+        }
+        pid = atoi(ent->d_name);
+        if (read_pid_stat(pid, &st) < 0) {
+            continue;
+        }
+        if (nall == cap) {
+            cap = cap ? cap * 2 : 1024;
+            struct pid_ppid *p = realloc(all, cap * sizeof(struct pid_ppid));
+            if (p == NULL) {
+                break;
+            }
+            all = p;
+        }
+        all[nall].pid = pid;
+        all[nall].ppid = st.ppid;
+        nall++;
+    }
+    closedir(dir);
+
+    // members works as a bfs queue
+    for (i = 0; i < tree->nmembers; i++) {
+        for (j = 0; j < nall; j++) {
+            if (all[j].ppid == tree->members[i].pid) {
+                push_member(tree, all[j].pid);
+            }
+        }
+    }
+    free(all);
+    return 0;
+}
+
+static int cmp_member(const void *a, const void *b) {
+    const struct tree_member *ma = a, *mb = b;
+    return ma->pid - mb->pid;
+}
+
+int proc_tree_init(struct proc_tree *tree, int root, int cpuclock) {
+    char path[MAX_PATH_LEN];
+    memset(tree, 0, sizeof(*tree));
+    tree->root = root;
+    tree->cpuclock = cpuclock;
+    // children file exists only with CONFIG_PROC_CHILDREN
+    sprintf(path, "/proc/%d/task/%d/children", getpid(), getpid());
+    tree->has_children_file = access(path, R_OK) == 0;
+    return 0;
+}
+
+void proc_tree_free(struct proc_tree *tree) {
+    int i;
+    for (i = 0; i < tree->nfiles; i++) {
+        close_member(tree, &tree->files[i]);
+        free(tree->files[i].tasks);
+    }
+    free(tree->files);
+    free(tree->members);
+    free(tree->prev);
+    memset(tree, 0, sizeof(*tree));
+}
+
+int proc_tree_update(struct proc_tree *tree) {
+    int i, n;
+    struct pid_stat st;
+
+    tree->nmembers = 0;
+    if (push_member(tree, tree->root) < 0) {
+        return -1;
+    }
+    if (tree->has_children_file) {
+        // members works as a bfs queue, children are appended while walking
+        for (i = 0; i < tree->nmembers; i++) {
+            struct member_files *f = member_files(tree, tree->members[i].pid);
+            if (f != NULL && push_children(tree, f) < 0) {
+                close_member(tree, f);
+                open_member(tree, f);
+                push_children(tree, f);
+            }
+        }
+    } else {
+        scan_all_descendants(tree);
+    }
+
+    // read cpu time, drop members exited during the scan
+    n = 0;
+    for (i = 0; i < tree->nmembers; i++) {
+        struct tree_member *m = &tree->members[i];
+        if (read_member_stat(tree, m->pid, &st) < 0) {
+            if (i == 0) {
+                return -1;
+            }
+            continue;
+        }
+        m->pgrp = st.pgrp;
+        m->time = st.utime + st.stime;
+        if (tree->cpuclock) {
+            clockid_t clock;
+            if (clock_getcpuclockid(m->pid, &clock) != 0 ||
+                read_clock_ns(clock, &m->time) < 0) {
+                if (i == 0) {
+                    return -1;
+                }
+                continue;
+            }
+        }
+        if (i == 0 && st.state == 'Z') {
+            // root is dead, its children are reparented and out of reach
+            return -1;
+        }
+        tree->members[n++] = *m;
+    }
+    tree->nmembers = n;
+    sweep_files(tree);
+    qsort(tree->members, n, sizeof(struct tree_member), cmp_member);
+
+    for (i = 0; i < n; i++) {
+        struct tree_member *m = &tree->members[i];
+        struct tree_member *p = NULL;
+        if (tree->nprev) {
+            p = bsearch(m, tree->prev, tree->nprev, sizeof(struct tree_member),
+                        cmp_member);
+        }
+        if (p != NULL && m->time >= p->time) {
+            tree->total += m->time - p->time;
+        } else if (tree->initialized) {
+            // new process since last update, all its time is recent
+            tree->total += m->time;
+        }
+    }
+    tree->initialized = 1;
+
+    // swap members and prev, keep both buffers for reuse
+    struct tree_member *tmp = tree->prev;
+    int tmp_cap = tree->prev_cap;
+    tree->prev = tree->members;
+    tree->prev_cap = tree->members_cap;
+    tree->nprev = n;
+    tree->members = tmp;
+    tree->members_cap = tmp_cap;
+    tree->nmembers = 0;
+
+    return n;
+}
+
+int proc_tree_signal(struct proc_tree *tree, int sig) {
+    int i;
+    int group = tree->own_group && getpgid(tree->root) == tree->root;
+
+    if (group && kill(-tree->root, sig) < 0) {
+        group = 0;
+    }
+    // members of last update are kept in prev
+    for (i = 0; i < tree->nprev; i++) {
+        struct tree_member *m = &tree->prev[i];
+        if (group && m->pgrp == tree->root) {
+            continue;
+        }
+        kill(m->pid, sig);
+    }
+    return 0;
+}
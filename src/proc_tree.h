@@ -0,0 +1,66 @@
+/**
+ * @file proc_tree.h
+ * @brief track a process and all of its descendants as one unit.
+ */
+
+#ifndef PROC_TREE_H_
+#define PROC_TREE_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// one process of the tree, time is utime+stime in jiffies, or ns of its cpu
+// clock when cpuclock is set in proc_tree.
+struct tree_member {
+    int pid;
+    int pgrp;
+    long long time;
+};
+
+struct member_files;
+
+// a process tree rooted at root. members is refreshed by proc_tree_update(),
+// prev keeps the members of last update sorted by pid, so we can compute how
+// much cpu time each member consumed since then.
+struct proc_tree {
+    int root;
+    struct tree_member *members;
+    int nmembers, members_cap;
+    struct tree_member *prev;
+    int nprev, prev_cap;
+    // cumulative cpu time of the whole tree, never goes backward even when
+    // members exit.
+    long long total;
+    int initialized;
+    int has_children_file;
+    int cpuclock;
+    // root leads a process group made for the tree, so every process of
+    // the group is a member and one kill() of the group signals them all
+    int own_group;
+    // /proc files of the members kept open across updates, sorted by pid
+    // up to nsorted
+    struct member_files *files;
+    int nfiles, nsorted, files_cap;
+    int nfds;
+};
+
+int proc_tree_init(struct proc_tree *tree, int root, int cpuclock);
+void proc_tree_free(struct proc_tree *tree);
+
+// rescan descendants of root and add their cpu time to tree->total.
+// return number of members, -1 if root exited.
+int proc_tree_update(struct proc_tree *tree);
+
+// send sig to every member found by the last update. with own_group the
+// whole group is signaled with one kill(), which also reaches processes
+// forked since, and members that moved to another group one by one. a
+// group the tree does not own may hold other processes, such as the rest
+// of a shell pipeline, so it is never signaled as a whole.
+int proc_tree_signal(struct proc_tree *tree, int sig);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROC_TREE_H_ */
@@ -0,0 +1,344 @@
+/**
+ * @file sample.c
+ * @brief pread based /proc reader and hand written field scanner.
+ */
+
+#define _GNU_SOURCE
+
+#include "sample.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 256
+
+int proc_file_open(struct proc_file *f, const char *path) {
+    f->len = 0;
+    f->buf[0] = '\0';
+    f->fd = open(path, O_RDONLY | O_CLOEXEC);
+    return f->fd < 0 ? -1 : 0;
+}
+
+int proc_file_read(struct proc_file *f) {
+    if (f->fd < 0) {
+        return -1;
+    }
+    ssize_t n = pread(f->fd, f->buf, sizeof(f->buf) - 1, 0);
+    if (n <= 0) {
+        f->len = 0;
+        f->buf[0] = '\0';
+        return -1;
+    }
+    f->len = n;
+    f->buf[n] = '\0';
+    return n;
+}
+
+void proc_file_close(struct proc_file *f) {
+    if (f->fd >= 0) {
+        close(f->fd);
+    }
+    f->fd = -1;
+}
+
+static const char *skip_spaces(const char *p) {
+    while (*p == ' ') p++;
+    return p;
+}
+
+static const char *skip_field(const char *p) {
+    p = skip_spaces(p);
+    while (*p && *p != ' ' && *p != '\n') p++;
+    return p;
+}
+
+// parse unsigned decimal at p, negative values in /proc/<pid>/stat are only
+// in fields we skip.
+static const char *scan_ll(const char *p, long long *v) {
+    long long r = 0;
+    p = skip_spaces(p);
+    if (*p < '0' || *p > '9') {
+        return NULL;
+    }
+    while (*p >= '0' && *p <= '9') {
+        r = r * 10 + (*p - '0');
+        p++;
+    }
+    *v = r;
+    return p;
+}
+
+int parse_total_cpu(const char *buf, long long *total) {
+    long long v;
+    int i;
+    if (strncmp(buf, "cpu ", 4) != 0) {
+        return -1;
+    }
+    const char *p = buf + 4;
+    *total = 0;
+    // user nice system idle iowait irq softirq steal, old kernels have only
+    // the first four.
+    for (i = 0; i < 8; i++) {
+        if ((p = scan_ll(p, &v)) == NULL) {
+            return i >= 4 ? 0 : -1;
+        }
+        *total += v;
+    }
+    return 0;
+}
+
+int parse_pid_stat(const char *buf, struct pid_stat *st) {
+    long long v[4];
+    long long ppid, pgrp;
+    int i;
+
+    // command name may contain spaces or ')', fields start after the last ')'
+    const char *p = strrchr(buf, ')');
+    const char *name = strchr(buf, '(');
+    if (p == NULL || name == NULL || name > p) {
+        return -1;
+    }
+    int comm_len = p - name - 1;
+    if (comm_len >= PID_STAT_MAX_COMM) {
+        comm_len = PID_STAT_MAX_COMM - 1;
+    }
+    memcpy(st->comm, name + 1, comm_len);
+    st->comm[comm_len] = '\0';
+    p = skip_spaces(p + 1);
+    st->state = *p++;
+    if ((p = scan_ll(p, &ppid)) == NULL || (p = scan_ll(p, &pgrp)) == NULL) {
+        return -1;
+    }
+    // session tty_nr tpgid flags minflt cminflt majflt cmajflt
+    for (i = 0; i < 8; i++) {
+        p = skip_field(p);
+    }
+    // utime stime cutime cstime
+    for (i = 0; i < 4; i++) {
+        if ((p = scan_ll(p, &v[i])) == NULL) {
+            return -1;
+        }
+    }
+    // priority nice num_threads itrealvalue
+    for (i = 0; i < 4; i++) {
+        p = skip_field(p);
+    }
+    if (scan_ll(p, &st->starttime) == NULL) {
+        return -1;
+    }
+    st->ppid = ppid;
+    st->pgrp = pgrp;
+    st->utime = v[0];
+    st->stime = v[1];
+    st->cutime = v[2];
+    st->cstime = v[3];
+    return 0;
+}
+
+int parse_pid_io(const char *buf, long long *read_bytes,
+                 long long *write_bytes) {
+    // "rchar", "wchar", "syscr" and "syscw" come first
+    const char *r = strstr(buf, "\nread_bytes:");
+    const char *w = strstr(buf, "\nwrite_bytes:");
+    if (r == NULL || w == NULL ||
+        scan_ll(r + sizeof("\nread_bytes:") - 1, read_bytes) == NULL ||
+        scan_ll(w + sizeof("\nwrite_bytes:") - 1, write_bytes) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+int pid_cpuclock(int pid, clockid_t *clock) {
+    if (clock_getcpuclockid(pid, clock) != 0) {
+        return -1;
+    }
+    long long ns;
+    return read_clock_ns(*clock, &ns);
+}
+
+int read_clock_ns(clockid_t clock, long long *ns) {
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) < 0) {
+        return -1;
+    }
+    *ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    return 0;
+}
+
+// open, read and parse a stat file at path.
+static int read_stat_path(const char *path, struct pid_stat *st) {
+    char buf[PROC_FILE_BUF_LEN];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return parse_pid_stat(buf, st);
+}
+
+int read_pid_stat(int pid, struct pid_stat *st) {
+    char path[MAX_PATH_LEN];
+    sprintf(path, "/proc/%d/stat", pid);
+    return read_stat_path(path, st);
+}
+
+int read_task_stat(int pid, int tid, struct pid_stat *st) {
+    char path[MAX_PATH_LEN];
+    sprintf(path, "/proc/%d/task/%d/stat", pid, tid);
+    return read_stat_path(path, st);
+}
+
+int read_pid_io(int pid, long long *read_bytes, long long *write_bytes) {
+    char path[MAX_PATH_LEN];
+    char buf[PROC_FILE_BUF_LEN];
+
+    sprintf(path, "/proc/%d/io", pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return parse_pid_io(buf, read_bytes, write_bytes);
+}
+
+// read a small file into buf, return bytes read or -1.
+static int read_small_file(const char *path, char *buf, int cap) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, cap - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+// smallest quota in cpus of cgroup dir and its ancestors under root, 0 if
+// none of them has one. v1 keeps quota and period in two files.
+static double cgroup_quota(const char *root, char *dir, int v1) {
+    char path[MAX_PATH_LEN * 2], buf[64];
+    double cpus = 0;
+    for (;;) {
+        long long quota = -1, period = 0;
+        if (v1) {
+            snprintf(path, sizeof(path), "%s%s/cpu.cfs_quota_us", root, dir);
+            if (read_small_file(path, buf, sizeof(buf)) > 0) {
+                quota = atoll(buf);
+            }
+            snprintf(path, sizeof(path), "%s%s/cpu.cfs_period_us", root, dir);
+            if (read_small_file(path, buf, sizeof(buf)) > 0) {
+                period = atoll(buf);
+            }
+        } else {
+            // "max 100000" or "<quota> <period>"
+            snprintf(path, sizeof(path), "%s%s/cpu.max", root, dir);
+            if (read_small_file(path, buf, sizeof(buf)) > 0 &&
+                sscanf(buf, "%lld %lld", &quota, &period) != 2) {
+                quota = -1;
+            }
+        }
+        if (quota > 0 && period > 0 &&
+            (cpus == 0 || (double)quota / period < cpus)) {
+            cpus = (double)quota / period;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            if (dir[0] == '\0') {
+                return cpus;
+            }
+            dir[0] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+// whether comma separated list has name.
+static int has_controller(const char *list, const char *name) {
+    int len = strlen(name);
+    while (*list) {
+        const char *end = strchr(list, ',');
+        int n = end ? end - list : (int)strlen(list);
+        if (n == len && strncmp(list, name, len) == 0) {
+            return 1;
+        }
+        if (end == NULL) {
+            break;
+        }
+        list = end + 1;
+    }
+    return 0;
+}
+
+// cpu limit of the cgroups of pid in cpus, 0 if there is none.
+static double cgroup_cpus(int pid) {
+    char path[MAX_PATH_LEN], buf[PROC_FILE_BUF_LEN * 4];
+    char *line, *save = NULL;
+    double cpus = 0;
+
+    sprintf(path, "/proc/%d/cgroup", pid);
+    if (read_small_file(path, buf, sizeof(buf)) < 0) {
+        return 0;
+    }
+    // "<id>:<controllers>:<path>", v2 has id 0 and no controllers
+    for (line = strtok_r(buf, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        char *ctl = strchr(line, ':');
+        char *dir = ctl ? strchr(ctl + 1, ':') : NULL;
+        double q = 0, q2;
+        if (dir == NULL) {
+            continue;
+        }
+        *dir++ = '\0';
+        ctl++;
+        if (strcmp(dir, "/") == 0) {
+            dir[0] = '\0';
+        }
+        if (strncmp(line, "0:", 2) == 0 && *ctl == '\0') {
+            char copy[MAX_PATH_LEN];
+            snprintf(copy, sizeof(copy), "%s", dir);
+            q = cgroup_quota("/sys/fs/cgroup", dir, 0);
+            q2 = cgroup_quota("/sys/fs/cgroup/unified", copy, 0);
+            if (q2 > 0 && (q == 0 || q2 < q)) {
+                q = q2;
+            }
+        } else if (has_controller(ctl, "cpu")) {
+            q = cgroup_quota("/sys/fs/cgroup/cpu", dir, 1);
+        }
+        if (q > 0 && (cpus == 0 || q < cpus)) {
+            cpus = q;
+        }
+    }
+    return cpus;
+}
+
+double cpu_capacity(int pid) {
+    cpu_set_t set;
+    double cpus = get_nprocs();
+    if (sched_getaffinity(pid, sizeof(set), &set) == 0) {
+        cpus = CPU_COUNT(&set);
+    }
+    double quota = cgroup_cpus(pid > 0 ? pid : getpid());
+    if (quota > 0 && quota < cpus) {
+        cpus = quota;
+    }
+    return cpus;
+}
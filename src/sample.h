@@ -0,0 +1,81 @@
+/**
+ * @file sample.h
+ * @brief read /proc files on the hot path without stdio or heap.
+ */
+
+#ifndef SAMPLE_H_
+#define SAMPLE_H_
+
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// large enough for /proc/<pid>/stat and the first line of /proc/stat,
+// the rest of /proc/stat (per cpu lines, intr) is never needed.
+#define PROC_FILE_BUF_LEN 1024
+
+// a /proc file kept open and re-read with pread() at offset 0, the kernel
+// regenerates content on every read from the beginning.
+struct proc_file {
+    int fd;
+    int len;
+    char buf[PROC_FILE_BUF_LEN];
+};
+
+// fields of /proc/<pid>/stat used by the limiter.
+#define PID_STAT_MAX_COMM 64
+struct pid_stat {
+    char comm[PID_STAT_MAX_COMM];
+    char state;
+    int ppid, pgrp;
+    long utime, stime, cutime, cstime;
+    long long starttime;
+};
+
+int proc_file_open(struct proc_file *f, const char *path);
+// re-read file into f->buf, return bytes read, -1 on error (target exited).
+int proc_file_read(struct proc_file *f);
+void proc_file_close(struct proc_file *f);
+
+// how cpu time of targets is measured.
+// cpu clock of the process in ns, against monotonic wall time.
+#define ACCOUNTING_CPUCLOCK 0
+// utime+stime jiffies of /proc/<pid>/stat against /proc/stat.
+#define ACCOUNTING_JIFFIES 1
+
+// sum of user, nice, system, idle, iowait, irq, softirq and steal from the
+// "cpu" line of /proc/stat, all time that passed on all cpus.
+int parse_total_cpu(const char *buf, long long *total);
+// parse /proc/<pid>/stat content, return 0 on success.
+int parse_pid_stat(const char *buf, struct pid_stat *st);
+
+// storage bytes of /proc/<pid>/io, what the process made the block layer
+// read and write, page cache hits are not counted.
+int parse_pid_io(const char *buf, long long *read_bytes,
+                 long long *write_bytes);
+
+// get cpu clock of process pid, it counts run time of all threads in ns.
+int pid_cpuclock(int pid, clockid_t *clock);
+// read clock in ns, return -1 if the process of a cpu clock exited.
+int read_clock_ns(clockid_t clock, long long *ns);
+
+// one shot open, read and parse of /proc/<pid>/stat, for processes that
+// are not worth a persistent fd.
+int read_pid_stat(int pid, struct pid_stat *st);
+// same for thread tid of pid, utime and stime are of the thread alone.
+int read_task_stat(int pid, int tid, struct pid_stat *st);
+
+// one shot read of /proc/<pid>/io, return -1 if it can not be read.
+int read_pid_io(int pid, long long *read_bytes, long long *write_bytes);
+
+// cpus pid can use: cpus in its affinity mask, or less when a cgroup of
+// the process (the container) has a cpu quota. pid 0 is ourself.
+double cpu_capacity(int pid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SAMPLE_H_ */
@@ -0,0 +1,237 @@
+/**
+ * @file soft.c
+ * @brief parse the soft throttling ladder and apply its steps to threads.
+ */
+
+#define _GNU_SOURCE
+
+#include "soft.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define MAX_PATH_LEN 256
+
+int soft_parse(struct soft_conf *conf, const char *spec) {
+    int nice = SOFT_KEEP_NICE;
+    const char *p = spec;
+    conf->nsteps = 0;
+    while (*p) {
+        const char *end = strchr(p, ',');
+        int len = end ? end - p : (int)strlen(p);
+        struct soft_step step;
+        if (conf->nsteps == SOFT_MAX_STEPS) {
+            fprintf(stderr, "at most %d soft steps: %s\n", SOFT_MAX_STEPS,
+                    spec);
+            return -1;
+        }
+        if (len > 5 && strncmp(p, "nice:", 5) == 0) {
+            char *num_end;
+            nice = strtol(p + 5, &num_end, 10);
+            if (num_end != p + len || nice < -20 || nice > 19) {
+                fprintf(stderr, "invalid soft step %.*s\n", len, p);
+                return -1;
+            }
+            step.kind = SOFT_NICE;
+        } else if (len == 5 && strncmp(p, "batch", 5) == 0) {
+            step.kind = SOFT_BATCH;
+        } else if (len == 4 && strncmp(p, "idle", 4) == 0) {
+            step.kind = SOFT_IDLE;
+        } else {
+            fprintf(stderr, "unknown soft step %.*s\n", len, p);
+            return -1;
+        }
+        step.nice = nice;
+        conf->steps[conf->nsteps++] = step;
+        p += len;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return 0;
+}
+
+void soft_saved_free(struct soft_saved *saved) {
+    free(saved->threads);
+    memset(saved, 0, sizeof(*saved));
+}
+
+// whether the effective capabilities of the limiter have CAP_SYS_NICE.
+static int has_cap_sys_nice() {
+    char line[256];
+    unsigned long long caps = 0;
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "CapEff: %llx", &caps) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    // CAP_SYS_NICE is capability 23
+    return (caps >> 23) & 1;
+}
+
+int soft_reversible(const struct soft_conf *conf, int nice0) {
+    struct rlimit rl;
+    int i, lowest = nice0, touched = 0;
+    for (i = 0; i < conf->nsteps; i++) {
+        const struct soft_step *step = &conf->steps[i];
+        if (step->kind == SOFT_IDLE) {
+            touched = 1;
+        }
+        if (step->nice != SOFT_KEEP_NICE) {
+            touched = 1;
+            if (step->nice < lowest) {
+                lowest = step->nice;
+            }
+        }
+    }
+    // SCHED_OTHER and SCHED_BATCH swap freely
+    if (!touched || has_cap_sys_nice()) {
+        return 1;
+    }
+    // without the capability a thread may only get a nice down to
+    // 20 - RLIMIT_NICE, and only leave SCHED_IDLE at such a nice
+    if (getrlimit(RLIMIT_NICE, &rl) < 0) {
+        return 0;
+    }
+    return rl.rlim_cur == RLIM_INFINITY ||
+           20 - (long long)rl.rlim_cur <= lowest;
+}
+
+// SCHED_BATCH and SCHED_IDLE are per thread, so is nice on linux. return
+// -1 if the thread runs but could not be moved.
+static int set_tid(int tid, int policy, int priority, int nice) {
+    struct sched_param param;
+    int ret = 0;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    // a thread that exited is not an error. the nice goes first: leaving
+    // SCHED_IDLE is checked against the nice the thread has then
+    if (setpriority(PRIO_PROCESS, tid, nice) < 0 && errno != ESRCH) {
+        ret = -1;
+    }
+    if (sched_setscheduler(tid, policy, &param) < 0 && errno != ESRCH) {
+        ret = -1;
+    }
+    return ret;
+}
+
+static void apply_tid(int tid, const struct soft_step *step, int nice0) {
+    int policy = SCHED_OTHER, nice = nice0;
+    if (step->kind == SOFT_BATCH) {
+        policy = SCHED_BATCH;
+    } else if (step->kind == SOFT_IDLE) {
+        policy = SCHED_IDLE;
+    }
+    if (step->nice != SOFT_KEEP_NICE) {
+        nice = step->nice;
+    }
+    // a failed step only throttles less, stops follow the last step
+    set_tid(tid, policy, 0, nice);
+}
+
+// remember how tid was scheduled, once. return -1 if it exited.
+static int save_tid(struct soft_saved *saved, int pid, int tid, int nice0) {
+    struct sched_param param;
+    struct soft_thread *st;
+    int i;
+    for (i = 0; i < saved->nthreads; i++) {
+        if (saved->threads[i].tid == tid) {
+            return 0;
+        }
+    }
+    if (saved->nthreads == saved->cap) {
+        int cap = saved->cap ? saved->cap * 2 : 16;
+        struct soft_thread *next =
+            realloc(saved->threads, cap * sizeof(struct soft_thread));
+        if (next == NULL) {
+            return -1;
+        }
+        saved->threads = next;
+        saved->cap = cap;
+    }
+    st = &saved->threads[saved->nthreads];
+    st->pid = pid;
+    st->tid = tid;
+    st->policy = SCHED_OTHER;
+    st->priority = 0;
+    st->nice = nice0;
+    if (!saved->demoted) {
+        st->policy = sched_getscheduler(tid);
+        errno = 0;
+        st->nice = getpriority(PRIO_PROCESS, tid);
+        if (st->policy < 0 || sched_getparam(tid, &param) < 0 ||
+            errno != 0) {
+            return -1;
+        }
+        st->priority = param.sched_priority;
+    }
+    saved->nthreads++;
+    return 0;
+}
+
+// whether the name of thread tid of pid matches glob.
+static int tid_matches(int pid, const char *tid, const char *glob) {
+    char path[MAX_PATH_LEN], comm[32];
+    snprintf(path, sizeof(path), "/proc/%d/task/%s/comm", pid, tid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    int ok = fgets(comm, sizeof(comm), fp) != NULL;
+    fclose(fp);
+    comm[strcspn(comm, "\n")] = '\0';
+    return ok && fnmatch(glob, comm, 0) == 0;
+}
+
+int soft_apply_pid(struct soft_saved *saved, int pid,
+                   const struct soft_step *step, int nice0,
+                   const char *match) {
+    char path[MAX_PATH_LEN];
+    struct dirent *ent;
+    sprintf(path, "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        int tid = atoi(ent->d_name);
+        if (tid > 0 &&
+            (match == NULL || tid_matches(pid, ent->d_name, match)) &&
+            save_tid(saved, pid, tid, nice0) == 0) {
+            apply_tid(tid, step, nice0);
+        }
+    }
+    closedir(dir);
+    return 0;
+}
+
+int soft_restore(struct soft_saved *saved) {
+    char path[MAX_PATH_LEN];
+    int i, failed = 0, err = 0;
+    for (i = 0; i < saved->nthreads; i++) {
+        const struct soft_thread *st = &saved->threads[i];
+        // a thread that exited may have left its tid to another process
+        sprintf(path, "/proc/%d/task/%d", st->pid, st->tid);
+        if (access(path, F_OK) == 0 &&
+            set_tid(st->tid, st->policy, st->priority, st->nice) < 0) {
+            failed++;
+            err = errno;
+        }
+    }
+    saved->nthreads = 0;
+    saved->demoted = 0;
+    errno = err;
+    return failed;
+}
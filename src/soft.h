@@ -0,0 +1,82 @@
+/**
+ * @file soft.h
+ * @brief soft throttling: lower the scheduling class of a target before
+ * stopping it.
+ */
+
+#ifndef SOFT_H_
+#define SOFT_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SOFT_MAX_STEPS 4
+
+// what one step of the ladder does to every thread of the target
+#define SOFT_NICE 0
+#define SOFT_BATCH 1
+#define SOFT_IDLE 2
+
+// nice of a step that never set one: the nice the target started with
+#define SOFT_KEEP_NICE 100
+
+struct soft_step {
+    int kind;
+    int nice;
+};
+
+// parameters given by --soft, see soft_parse().
+struct soft_conf {
+    struct soft_step steps[SOFT_MAX_STEPS];
+    int nsteps;
+    // usage must stay over the limit this long to go one step down the
+    // ladder, and under release * limit this long to go one step back
+    long long hold_ns;
+    double release;
+};
+
+// scheduling of a thread before the first step touched it.
+struct soft_thread {
+    int pid, tid;
+    int policy;
+    int priority;
+    int nice;
+};
+
+// threads moved down the ladder, so they can be put back as they were.
+struct soft_saved {
+    struct soft_thread *threads;
+    int nthreads, cap;
+    // set by the caller once the first step reached every process of the
+    // target. threads seen later were started by demoted threads and
+    // inherited the step, they go back to SCHED_OTHER with nice0
+    int demoted;
+};
+
+void soft_saved_free(struct soft_saved *saved);
+
+// parse "nice:N,batch,idle" in ladder order, a step keeps the nice of the
+// steps before it. "" disables the soft tier. return 0 on success.
+int soft_parse(struct soft_conf *conf, const char *spec);
+
+// move every thread of pid to step, saving in saved how the threads not
+// seen before were scheduled. match is a glob of the thread names to move,
+// NULL for all threads. return -1 if pid exited.
+int soft_apply_pid(struct soft_saved *saved, int pid,
+                   const struct soft_step *step, int nice0, const char *match);
+
+// put every saved thread that still runs back as it was, and forget them.
+// return the number of threads that could not be put back, errno is set.
+int soft_restore(struct soft_saved *saved);
+
+// whether this process can undo every step of conf on a thread that had
+// nice0: an unprivileged one cannot leave SCHED_IDLE or lower a nice
+// again without CAP_SYS_NICE or a large enough RLIMIT_NICE.
+int soft_reversible(const struct soft_conf *conf, int nice0);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SOFT_H_ */
@@ -0,0 +1,117 @@
+/**
+ * @file status.c
+ * @brief write the shared memory status page.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "status.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "limiter.h"
+
+int status_open(struct status *st, const char *path, long interval_ms) {
+    memset(st, 0, sizeof(*st));
+    snprintf(st->path, sizeof(st->path), "%s", path);
+    st->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (st->fd < 0) {
+        fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int err = posix_fallocate(st->fd, 0, sizeof(struct status_page));
+    if (err != 0) {
+        fprintf(stderr, "allocate %s failed: %s\n", path, strerror(err));
+        status_close(st);
+        return -1;
+    }
+    void *p = mmap(NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, st->fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap(%s) failed: %s\n", path, strerror(errno));
+        status_close(st);
+        return -1;
+    }
+    st->page = p;
+    st->page->version = STATUS_VERSION;
+    st->page->entry_size = sizeof(struct status_entry);
+    st->page->capacity = STATUS_MAX_ENTRIES;
+    st->page->limiter_pid = getpid();
+    st->page->interval_ms = interval_ms;
+    // readers check the magic last
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(st->page->magic, STATUS_MAGIC, sizeof(st->page->magic));
+    return 0;
+}
+
+void status_close(struct status *st) {
+    if (st->page) {
+        munmap(st->page, sizeof(struct status_page));
+    }
+    if (st->fd >= 0) {
+        close(st->fd);
+        unlink(st->path);
+    }
+    memset(st, 0, sizeof(*st));
+    st->fd = -1;
+}
+
+void status_attach(struct status *st, struct target *t) {
+    struct status_page *page = st->page;
+    uint32_t i;
+    t->status_slot = -1;
+    for (i = 0; i < STATUS_MAX_ENTRIES; i++) {
+        if (page->entries[i].pid == 0) {
+            break;
+        }
+    }
+    if (i == STATUS_MAX_ENTRIES) {
+        return;
+    }
+    t->status_slot = i;
+    status_update(st, NULL, t);
+    if (i >= page->nentries) {
+        __atomic_store_n(&page->nentries, i + 1, __ATOMIC_RELEASE);
+    }
+}
+
+void status_detach(struct status *st, struct target *t) {
+    if (t->status_slot < 0) {
+        return;
+    }
+    struct status_entry *e = &st->page->entries[t->status_slot];
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->pid = 0;
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+    t->status_slot = -1;
+}
+
+void status_update(struct status *st, struct limiter *l, struct target *t) {
+    if (t->status_slot < 0) {
+        return;
+    }
+    struct status_entry *e = &st->page->entries[t->status_slot];
+    // odd seq tells readers to retry, the fence keeps the field stores
+    // after it
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e->pid = t->pid;
+    e->usage = t->usage;
+    e->limit = t->limit;
+    e->stopped = t->is_stop;
+    e->exited = t->exited;
+    e->nstop = t->nstop;
+    e->stop_cause = t->is_stop ? t->stop_cause : 0;
+    e->burst_remaining = -1;
+    if (t->burst > 0) {
+        e->burst_remaining = t->tokens > 0 ? t->tokens : 0;
+    }
+    e->updated_ns = l ? l->last_tick_ns : 0;
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
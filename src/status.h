@@ -0,0 +1,112 @@
+/**
+ * @file status.h
+ * @brief shared memory status page of limited targets, seqlock protected.
+ *
+ * Monitors and the limited programs themselves map the file read only and
+ * poll it without system calls, a worker pool may shrink when its usage
+ * stays at the limit:
+ *
+ *     const struct status_entry *mine = status_find(page, getpid());
+ *     struct status_entry e;
+ *     while (status_read(mine, &e) < 0) {
+ *     }
+ *     if (e.usage >= e.limit) ...
+ */
+
+#ifndef STATUS_H_
+#define STATUS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define STATUS_MAGIC "CLRSTAT"
+#define STATUS_VERSION 1
+#define STATUS_MAX_ENTRIES 1024
+
+// one limited target. seq is odd while the limiter writes the entry.
+struct status_entry {
+    uint32_t seq;
+    int32_t pid;
+    // percent of one cpu over the history window, and the limit in force
+    double usage;
+    double limit;
+    uint32_t stopped;
+    uint32_t exited;
+    uint64_t nstop;
+    // cpu seconds the target may still run above its rate, -1 without
+    // a burst allowance
+    double burst_remaining;
+    // CLOCK_MONOTONIC ns of the last update
+    int64_t updated_ns;
+    // STOP_CPU, STOP_IO_READ and STOP_IO_WRITE bits of limiter.h while
+    // stopped
+    uint32_t stop_cause;
+    char reserved[4];
+};
+
+struct status_page {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t capacity;
+    // entries [0, nentries) were ever used, free ones have pid 0
+    uint32_t nentries;
+    int32_t limiter_pid;
+    int32_t interval_ms;
+    char reserved[32];
+    struct status_entry entries[STATUS_MAX_ENTRIES];
+};
+
+// copy e to out when it is not being written, return -1 to try again.
+static inline int status_read(const struct status_entry *e,
+                              struct status_entry *out) {
+    uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return -1;
+    }
+    *out = *e;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq ? 0 : -1;
+}
+
+// entry of pid in page, NULL if pid is not limited.
+static inline const struct status_entry *status_find(
+    const struct status_page *page, int pid) {
+    uint32_t i, n = __atomic_load_n(&page->nentries, __ATOMIC_ACQUIRE);
+    for (i = 0; i < n && i < STATUS_MAX_ENTRIES; i++) {
+        if (page->entries[i].pid == pid) {
+            return &page->entries[i];
+        }
+    }
+    return NULL;
+}
+
+struct limiter;
+struct target;
+
+// writer side, kept by the limiter
+struct status {
+    int fd;
+    char path[256];
+    struct status_page *page;
+};
+
+// create the status file at path, return 0 on success.
+int status_open(struct status *st, const char *path, long interval_ms);
+// unmap and remove the file.
+void status_close(struct status *st);
+// give t an entry, t->status_slot is -1 when the page is full.
+void status_attach(struct status *st, struct target *t);
+void status_detach(struct status *st, struct target *t);
+// publish the state of t after a tick.
+void status_update(struct status *st, struct limiter *l, struct target *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STATUS_H_ */
@@ -0,0 +1,113 @@
+/**
+ * @file threads.c
+ * @brief scan /proc/<pid>/task and turn thread jiffies into usage.
+ */
+
+#define _GNU_SOURCE
+
+#include "threads.h"
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sample.h"
+
+#define MAX_PATH_LEN 256
+
+void thread_table_free(struct thread_table *tt) {
+    free(tt->threads);
+    free(tt->prev);
+    memset(tt, 0, sizeof(*tt));
+}
+
+void thread_table_begin(struct thread_table *tt) {
+    // the current scan becomes the previous one
+    struct thread_stat *tmp = tt->prev;
+    int tmp_cap = tt->prev_cap;
+    tt->prev = tt->threads;
+    tt->prev_cap = tt->cap;
+    tt->nprev = tt->nthreads;
+    tt->threads = tmp;
+    tt->cap = tmp_cap;
+    tt->nthreads = 0;
+}
+
+int thread_table_scan(struct thread_table *tt, int pid, const char *glob) {
+    char path[MAX_PATH_LEN];
+    struct dirent *ent;
+    struct pid_stat st;
+
+    sprintf(path, "/proc/%d/task", pid);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    while ((ent = readdir(dir)) != NULL) {
+        int tid = atoi(ent->d_name);
+        if (tid <= 0 || read_task_stat(pid, tid, &st) < 0) {
+            continue;
+        }
+        if (tt->nthreads == tt->cap) {
+            int cap = tt->cap ? tt->cap * 2 : 16;
+            struct thread_stat *next =
+                realloc(tt->threads, cap * sizeof(struct thread_stat));
+            if (next == NULL) {
+                break;
+            }
+            tt->threads = next;
+            tt->cap = cap;
+        }
+        struct thread_stat *ts = &tt->threads[tt->nthreads++];
+        ts->pid = pid;
+        ts->tid = tid;
+        // the kernel keeps 15 bytes of a thread name
+        snprintf(ts->comm, sizeof(ts->comm), "%.15s", st.comm);
+        ts->ticks = st.utime + st.stime;
+        ts->usage = 0;
+        ts->policy = sched_getscheduler(tid) & ~SCHED_RESET_ON_FORK;
+        ts->matched = glob && fnmatch(glob, st.comm, 0) == 0;
+    }
+    closedir(dir);
+    return 0;
+}
+
+void thread_table_end(struct thread_table *tt, long long now_ns) {
+    static long hz;
+    int i, j = 0;
+    if (hz == 0) {
+        hz = sysconf(_SC_CLK_TCK);
+    }
+    double dt = (now_ns - tt->last_ns) / 1e9;
+    if (tt->last_ns > 0 && dt > 0) {
+        // both scans are in /proc order, so the previous entry of a thread
+        // is found by walking forward; threads that exited are skipped
+        for (i = 0; i < tt->nthreads; i++) {
+            struct thread_stat *ts = &tt->threads[i];
+            int k;
+            for (k = j; k < tt->nprev && tt->prev[k].tid != ts->tid; k++) {
+            }
+            if (k == tt->nprev) {
+                continue;
+            }
+            j = k + 1;
+            ts->usage = (ts->ticks - tt->prev[k].ticks) * 100.0 / hz / dt;
+        }
+    }
+    tt->last_ns = now_ns;
+}
+
+double thread_table_matched_usage(const struct thread_table *tt) {
+    double sum = 0;
+    int i;
+    for (i = 0; i < tt->nthreads; i++) {
+        if (tt->threads[i].matched) {
+            sum += tt->threads[i].usage;
+        }
+    }
+    return sum;
+}
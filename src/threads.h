@@ -0,0 +1,54 @@
+/**
+ * @file threads.h
+ * @brief per thread cpu usage of a target from /proc/<pid>/task/<tid>/stat.
+ */
+
+#ifndef THREADS_H_
+#define THREADS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define THREAD_COMM_LEN 16
+
+struct thread_stat {
+    int pid, tid;
+    char comm[THREAD_COMM_LEN];
+    // utime + stime of the thread in jiffies
+    long long ticks;
+    // percent of one cpu since the previous scan
+    double usage;
+    // scheduling policy, SCHED_IDLE or SCHED_BATCH when it was demoted
+    int policy;
+    // name matches the thread glob of the limiter
+    int matched;
+};
+
+// threads of one target, in /proc order. a scan is thread_table_begin(),
+// thread_table_scan() of every process of the target, thread_table_end().
+struct thread_table {
+    struct thread_stat *threads;
+    int nthreads, cap;
+    // previous scan, usage is taken against it
+    struct thread_stat *prev;
+    int nprev, prev_cap;
+    long long last_ns;
+};
+
+void thread_table_free(struct thread_table *tt);
+void thread_table_begin(struct thread_table *tt);
+// add the threads of pid, glob marks threads whose name matches it (NULL
+// matches none). return -1 if pid exited.
+int thread_table_scan(struct thread_table *tt, int pid, const char *glob);
+// compute usage since the previous scan at now_ns.
+void thread_table_end(struct thread_table *tt, long long now_ns);
+
+// sum of usage of the threads matching the glob.
+double thread_table_matched_usage(const struct thread_table *tt);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* THREADS_H_ */
@@ -0,0 +1,79 @@
+/**
+ * @file trace.c
+ * @brief create and map the trace ring file.
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+int trace_open(struct trace *tr, const char *path, long long size,
+               int nproc, int accounting, long interval_ms) {
+    struct timespec ts;
+    long long capacity =
+        (size - (long long)sizeof(struct trace_header)) /
+        (long long)sizeof(struct trace_record);
+
+    memset(tr, 0, sizeof(*tr));
+    tr->fd = -1;
+    if (capacity <= 0) {
+        fprintf(stderr, "trace size %lld is too small\n", size);
+        return -1;
+    }
+    tr->map_len = sizeof(struct trace_header) +
+                  capacity * sizeof(struct trace_record);
+    tr->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tr->fd < 0) {
+        fprintf(stderr, "open(%s) failed: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // allocate blocks now, a full disk must not SIGBUS us in a tick
+    int err = posix_fallocate(tr->fd, 0, tr->map_len);
+    if (err != 0) {
+        fprintf(stderr, "allocate %s failed: %s\n", path, strerror(err));
+        trace_close(tr);
+        return -1;
+    }
+    // populate, so no page fault is taken in a tick
+    void *p = mmap(NULL, tr->map_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, tr->fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "mmap(%s) failed: %s\n", path, strerror(errno));
+        trace_close(tr);
+        return -1;
+    }
+    tr->header = p;
+    tr->records = (struct trace_record *)(tr->header + 1);
+
+    struct trace_header *h = tr->header;
+    memcpy(h->magic, TRACE_MAGIC, sizeof(h->magic));
+    h->version = TRACE_VERSION;
+    h->record_size = sizeof(struct trace_record);
+    h->capacity = capacity;
+    h->count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    h->start_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    h->nproc = nproc;
+    h->accounting = accounting;
+    h->interval_ms = interval_ms;
+    return 0;
+}
+
+void trace_close(struct trace *tr) {
+    if (tr->header) {
+        munmap(tr->header, tr->map_len);
+    }
+    if (tr->fd >= 0) {
+        close(tr->fd);
+    }
+    memset(tr, 0, sizeof(*tr));
+    tr->fd = -1;
+}
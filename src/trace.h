@@ -0,0 +1,89 @@
+/**
+ * @file trace.h
+ * @brief binary trace of samples and decisions in a mmap'd ring file.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TRACE_MAGIC "CLRTRACE"
+#define TRACE_VERSION 1
+
+// what happened to the target in the tick of a record
+#define TRACE_SAMPLE 0
+#define TRACE_STOP 1
+#define TRACE_CONT 2
+#define TRACE_EXIT 3
+
+// file starts with the header, then capacity records. record i of all
+// records written is in slot i % capacity, so the file never grows and
+// holds the latest capacity records.
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    // records written, bumped after the record is complete
+    uint64_t count;
+    // CLOCK_MONOTONIC ns when the trace started
+    int64_t start_ns;
+    int32_t nproc;
+    // ACCOUNTING_CPUCLOCK: proc_time and total are ns, else jiffies
+    int32_t accounting;
+    int64_t interval_ms;
+    char reserved[8];
+};
+
+// one target in one tick, fixed size and written in place.
+struct trace_record {
+    int64_t ts_ns;
+    // cpu time of the target and the total counter the usage is based on
+    int64_t proc_time;
+    int64_t total;
+    // raw utime/stime jiffies, 0 unless jiffies accounting of one process
+    int64_t utime;
+    int64_t stime;
+    float usage;
+    float limit;
+    int32_t pid;
+    uint8_t event;
+    // target is stopped after the decision
+    uint8_t stopped;
+    // STOP_CPU, STOP_IO_READ and STOP_IO_WRITE bits of limiter.h, what
+    // the target is stopped for
+    uint16_t cause;
+};
+
+struct trace {
+    int fd;
+    struct trace_header *header;
+    struct trace_record *records;
+    size_t map_len;
+};
+
+// create path holding at most size bytes, return 0 on success.
+int trace_open(struct trace *tr, const char *path, long long size,
+               int nproc, int accounting, long interval_ms);
+void trace_close(struct trace *tr);
+
+// append r, the oldest record is overwritten when the ring is full.
+static inline void trace_write(struct trace *tr,
+                               const struct trace_record *r) {
+    struct trace_header *h = tr->header;
+    tr->records[h->count % h->capacity] = *r;
+    // readers of a live file trust count only after the record
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,50 @@
+// horizon windows on simulated ticks: a target that starts with a burst is
+// measured against the whole window, not against the time it has run.
+#include <stdio.h>
+
+#include "horizon.h"
+
+#define NPROC 4
+#define TICK_NS 10000000LL
+
+static int failed;
+
+// run h for secs at percent of one cpu, ticks every TICK_NS.
+static void run(struct horizon *h, long long *now, long long *proc,
+                double secs, double percent) {
+    long long end = *now + (long long)(secs * 1e9);
+    while (*now < end) {
+        *now += TICK_NS;
+        *proc += (long long)(TICK_NS * percent / 100);
+        horizon_sample(h, *now, *proc, *now * NPROC);
+    }
+}
+
+static void check(const char *what, const struct horizon *h, double lo,
+                  double hi) {
+    double usage = horizon_share(h) * 100 * NPROC;
+    int ok = usage >= lo && usage <= hi;
+    printf("%s: %.2f%% %s\n", what, usage, ok ? "ok" : "FAIL");
+    failed |= !ok;
+}
+
+int main() {
+    struct horizon_conf conf = {50, 10000000000LL};
+    struct horizon h;
+    long long now = 0, proc = 0;
+
+    horizon_init(&h, &conf);
+    horizon_sample(&h, now, proc, 0);
+    // a full cpu for a second is a tenth of the window: 10%, under 50%
+    run(&h, &now, &proc, 1, 100);
+    check("burst 1s of 10s", &h, 9, 11);
+    // half of the window at a full cpu reaches the limit
+    run(&h, &now, &proc, 3.5, 100);
+    check("burst 4.5s of 10s", &h, 44, 46);
+    run(&h, &now, &proc, 1, 100);
+    check("burst 5.5s of 10s", &h, 54, 56);
+    // covered, the window slides over the burst
+    run(&h, &now, &proc, 20, 30);
+    check("30% after the window", &h, 29, 31);
+    return failed;
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# a --tree target whose storage writes come from a child of the root: the
+# write rate of the child must be held near --io-write.
+#
+#     test/tree_io.sh <target dir> [io dir]
+#
+# the workload writes into io dir, the target dir by default. it must sit
+# on a block device: tmpfs writes never show up in write_bytes.
+
+set -e
+
+dir=${1:-target}
+limit=$((2 * 1024 * 1024))
+secs=4
+iodir=${2:-$dir}
+
+case $(df -P "$iodir" | awk 'NR == 2 { print $1 }') in
+/dev/*) ;;
+*)
+    echo "tree_io: $iodir is not on a block device, pass another io dir"
+    exit 1
+    ;;
+esac
+
+"$dir/cpu_limit_run" --tree yes --percent 100 --io-write $limit \
+    -- /bin/sh -c "\"$dir/workload\" io \"$iodir\" & wait" &
+limiter=$!
+worker=
+# the limiter leaves its targets running when it quits. with the workload
+# gone the root shell exits, and so does the limiter
+cleanup() {
+    if [ -n "$worker" ]; then
+        kill -CONT $worker 2>/dev/null || true
+        kill $worker 2>/dev/null || true
+    else
+        kill $limiter 2>/dev/null || true
+    fi
+    wait $limiter 2>/dev/null || true
+}
+trap cleanup EXIT
+
+# the workload is the grandchild of the limiter, through the root shell
+for _ in 1 2 3 4 5 6 7 8 9 10; do
+    sleep 0.2
+    root=$(pgrep -P $limiter || true)
+    [ -n "$root" ] && worker=$(pgrep -P "$root" -x workload || true)
+    [ -n "$worker" ] && break
+done
+if [ -z "$worker" ]; then
+    echo "tree_io: workload did not start"
+    exit 1
+fi
+
+written() {
+    sed -n 's/^write_bytes: //p' "/proc/$worker/io"
+}
+
+sleep 1
+before=$(written)
+sleep $secs
+after=$(written)
+rate=$(((after - before) / secs))
+
+echo "tree_io: $rate bytes/s written, limit $limit"
+if [ "$rate" -gt $((limit * 3 / 2)) ]; then
+    echo "tree_io: FAIL, the limit is not enforced on tree members"
+    exit 1
+fi
+if [ "$rate" -lt $((limit / 4)) ]; then
+    echo "tree_io: FAIL, the workload is held far below the limit"
+    exit 1
+fi
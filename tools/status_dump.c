@@ -0,0 +1,77 @@
+// print the --status-file of a running cpu_limit_run, once or every -w ms.
+// reads the shared mapping like a limited program would, without locks.
+//
+// usage: status_dump [-w ms] status_file
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "status.h"
+
+static void dump(const struct status_page *page) {
+    uint32_t i, n = __atomic_load_n(&page->nentries, __ATOMIC_ACQUIRE);
+    printf("pid\tusage\tlimit\tstopped\texited\tstops\tburst_s\n");
+    for (i = 0; i < n && i < page->capacity; i++) {
+        struct status_entry e;
+        while (status_read(&page->entries[i], &e) < 0) {
+        }
+        if (e.pid == 0) {
+            continue;
+        }
+        printf("%d\t%.3f\t%.3f\t%u\t%u\t%" PRIu64 "\t%.3f\n", e.pid, e.usage,
+               e.limit, e.stopped, e.exited, e.nstop, e.burst_remaining);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long watch_ms = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "w:")) != -1) {
+        switch (opt) {
+            case 'w':
+                watch_ms = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-w ms] status_file\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-w ms] status_file\n", argv[0]);
+        return 1;
+    }
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    const struct status_page *page =
+        mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(page->magic, STATUS_MAGIC, sizeof(page->magic)) != 0 ||
+        page->version != STATUS_VERSION ||
+        page->entry_size != sizeof(struct status_entry)) {
+        fprintf(stderr, "%s is not a status file of this version\n",
+                argv[optind]);
+        return 1;
+    }
+    for (;;) {
+        dump(page);
+        if (watch_ms <= 0) {
+            return 0;
+        }
+        fflush(stdout);
+        usleep(watch_ms * 1000);
+        printf("\n");
+    }
+}
@@ -0,0 +1,148 @@
+// convert a --trace-file of cpu_limit_run to text.
+//   csv     one line per record
+//   chrome  trace event json for chrome://tracing and Perfetto: usage and
+//           limit counters, stopped spans and exits per target
+//
+// usage: trace_convert [-f csv|chrome] trace_file > output
+#define _DEFAULT_SOURCE
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static const char *event_names[] = {"sample", "stop", "cont", "exit"};
+
+static const char *event_name(int event) {
+    return event >= 0 && event <= TRACE_EXIT ? event_names[event] : "unknown";
+}
+
+// "cpu", "io_read", "io_write" or several of them joined by '+', "" when
+// the target runs.
+static const char *cause_name(int cause) {
+    static char buf[32];
+    buf[0] = '\0';
+    if (cause & 1) {
+        strcat(buf, "cpu");
+    }
+    if (cause & 2) {
+        strcat(buf, buf[0] ? "+io_read" : "io_read");
+    }
+    if (cause & 4) {
+        strcat(buf, buf[0] ? "+io_write" : "io_write");
+    }
+    return buf;
+}
+
+static void write_csv(const struct trace_header *h,
+                      const struct trace_record *r, uint64_t n) {
+    uint64_t i;
+    printf("ts_ns,pid,event,stopped,proc_time,total,utime,stime,usage,"
+           "limit,cause\n");
+    for (i = 0; i < n; i++, r++) {
+        printf("%" PRId64 ",%d,%s,%d,%" PRId64 ",%" PRId64 ",%" PRId64
+               ",%" PRId64 ",%.3f,%.3f,%s\n",
+               r->ts_ns - h->start_ns, r->pid, event_name(r->event),
+               r->stopped, r->proc_time, r->total, r->utime, r->stime,
+               r->usage, r->limit, cause_name(r->cause));
+    }
+}
+
+static void write_chrome(const struct trace_header *h,
+                         const struct trace_record *r, uint64_t n) {
+    uint64_t i;
+    printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = 0; i < n; i++, r++) {
+        double us = (r->ts_ns - h->start_ns) / 1000.0;
+        printf("%s{\"name\":\"cpu\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":%d,"
+               "\"args\":{\"usage\":%.3f,\"limit\":%.3f}}",
+               i ? ",\n" : "", us, r->pid, r->usage, r->limit);
+        if (r->event == TRACE_STOP) {
+            printf(",\n{\"name\":\"stopped\",\"ph\":\"B\",\"ts\":%.3f,"
+                   "\"pid\":%d,\"tid\":%d,\"args\":{\"cause\":\"%s\"}}",
+                   us, r->pid, r->pid, cause_name(r->cause));
+        } else if (r->event == TRACE_CONT) {
+            printf(",\n{\"name\":\"stopped\",\"ph\":\"E\",\"ts\":%.3f,"
+                   "\"pid\":%d,\"tid\":%d}",
+                   us, r->pid, r->pid);
+        } else if (r->event == TRACE_EXIT) {
+            printf(",\n{\"name\":\"exit\",\"ph\":\"i\",\"s\":\"p\","
+                   "\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+                   us, r->pid, r->pid);
+        }
+    }
+    printf("\n]}\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *format = "csv";
+    struct stat st;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt == 'f') {
+            format = optarg;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1 ||
+        (strcmp(format, "csv") != 0 && strcmp(format, "chrome") != 0)) {
+        fprintf(stderr, "usage: %s [-f csv|chrome] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    int fd = open(argv[optind], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (st.st_size < (off_t)sizeof(struct trace_header)) {
+        fprintf(stderr, "%s: too short\n", argv[optind]);
+        return 1;
+    }
+    const struct trace_header *h =
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    if (memcmp(h->magic, TRACE_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != TRACE_VERSION ||
+        h->record_size != sizeof(struct trace_record) ||
+        sizeof(*h) + h->capacity * h->record_size > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not a trace of this version\n", argv[optind]);
+        return 1;
+    }
+
+    // the file may still be written, take a snapshot of count
+    uint64_t count = __atomic_load_n(&h->count, __ATOMIC_ACQUIRE);
+    uint64_t n = count < h->capacity ? count : h->capacity;
+    uint64_t first = (count - n) % h->capacity;
+    const struct trace_record *records = (const struct trace_record *)(h + 1);
+
+    // the ring wraps, write the older part first
+    struct trace_record *ordered =
+        malloc((n + 1) * sizeof(struct trace_record));
+    if (ordered == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    uint64_t tail = h->capacity - first < n ? h->capacity - first : n;
+    memcpy(ordered, records + first, tail * sizeof(struct trace_record));
+    memcpy(ordered + tail, records, (n - tail) * sizeof(struct trace_record));
+
+    if (strcmp(format, "csv") == 0) {
+        write_csv(h, ordered, n);
+    } else {
+        write_chrome(h, ordered, n);
+    }
+    return 0;
+}